@@ -0,0 +1,81 @@
+// Page allocator benchmark.
+// Runs 1..NWORKER processes in parallel, each looping over
+// sbrk() grow/shrink and fork()/exit(), and reports how many
+// operations finished per clock tick. Boot with CPUS=1..8
+// to see how kalloc()/kfree() scale across processors.
+// sbrk() allocates pages only when they are touched, and
+// fork() copies them only when they are written, so the
+// worker touches every new page and the child writes them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NWORKER 8
+#define NITER   200
+#define NPAGES  16   // pages grown and shrunk by each sbrk op
+
+// Touch each of the n pages at a.
+void
+touch(char *a, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    a[i*4096] = i;
+}
+
+void
+worker(void)
+{
+  int i, pid;
+  char *a;
+
+  for(i = 0; i < NITER; i++){
+    if((a = sbrk(NPAGES*4096)) == (char*)-1){
+      printf(1, "allocbench: sbrk failed\n");
+      exit();
+    }
+    touch(a, NPAGES);
+    pid = fork();
+    if(pid < 0){
+      printf(1, "allocbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      touch(a, NPAGES);
+      exit();
+    }
+    wait();
+    sbrk(-NPAGES*4096);
+  }
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, max, start, t;
+
+  max = NWORKER;
+  if(argc > 1)
+    max = atoi(argv[1]);
+
+  printf(1, "allocbench: %d iterations of %d-page sbrk and fork per worker\n",
+         NITER, NPAGES);
+  for(n = 1; n <= max; n++){
+    start = uptime();
+    for(i = 0; i < n; i++){
+      if(fork() == 0)
+        worker();
+    }
+    for(i = 0; i < n; i++)
+      wait();
+    t = uptime() - start;
+    if(t == 0)
+      t = 1;
+    printf(1, "%d workers: %d ops in %d ticks, %d ops/100 ticks\n",
+           n, n*NITER, t, n*NITER*100/t);
+  }
+  exit();
+}
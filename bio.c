@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,79 +17,283 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are hashed on (dev, blockno) into NBUCKET chains,
+// each protected by its own spin-lock, so lookups of different
+// blocks rarely contend.  A bucket lock protects the chain and
+// the dev, blockno, refcnt and lastuse fields of the buffers on it.
+// Recycling a buffer moves it between chains and needs two bucket
+// locks; bcache.lock serializes recycling, so at most one process
+// ever holds more than one bucket lock and there is no deadlock.
+// Recycling sweeps the chains like a clock hand and takes the
+// least recently used unused buffer among the next BSCAN chains
+// that have one, so a miss does not have to look at every
+// buffer in a large cache but a recently used buffer is not
+// evicted just because the hand reached its chain.
+//
+// breadahead() starts reading a block without waiting for it.
+// The buffer stays locked, owned by no process, until ideintr()
+// finishes the read and calls bdone() to release it.
+// bwritestart() and bwait() let a caller keep several writes
+// in flight at once.
+//
+// The buffers are carved out of kalloc() pages by binit().
+// Unless NBUF is set at build time, the cache gets
+// 1/BCACHEDIV of the free memory, within MINNBUF..MAXNBUF.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
-struct {
+#define NBUCKET   1031  // prime
+#define BCACHEDIV 16
+#define BSCAN     8     // chains compared per recycle
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;    // chain of buffers through prev/next
+  uint hits;           // lookups that found the block cached
+  uint misses;         // lookups that had to recycle a buffer
+  uint ahead;          // blocks queued by breadahead()
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling
+  int nbuf;
+  int hand;              // next chain to recycle from
+  int nahead;            // read-ahead buffers waiting for the disk
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bk->head;
+  if(bk->head)
+    bk->head->prev = b;
+  bk->head = b;
+}
+
+// Must be called after kinit2(), since the buffers
+// are allocated from the page allocator.
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  char *hdr, *data;
+  int i, nhdr, ndata;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+
+  bcache.nbuf = NBUF;
+  if(bcache.nbuf == 0)
+    bcache.nbuf = kfreecount() / BCACHEDIV * (PGSIZE / BSIZE);
+  if(bcache.nbuf < MINNBUF)
+    bcache.nbuf = MINNBUF;
+  if(bcache.nbuf > MAXNBUF)
+    bcache.nbuf = MAXNBUF;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Carve buffer headers and data blocks out of whole pages,
+  // and spread the buffers over the chains.
+  hdr = data = 0;
+  nhdr = ndata = 0;
+  for(i = 0; i < bcache.nbuf; i++){
+    if(nhdr == 0){
+      if((hdr = kalloc()) == 0)
+        break;
+      kown(hdr, PG_BUF);
+      nhdr = PGSIZE / sizeof(struct buf);
+    }
+    if(ndata == 0){
+      if((data = kalloc()) == 0)
+        break;
+      kown(data, PG_BUF);
+      ndata = PGSIZE / BSIZE;
+    }
+    b = (struct buf*)hdr;
+    hdr += sizeof(struct buf);
+    nhdr--;
+    memset(b, 0, sizeof(*b));
+    b->data = (uchar*)data;
+    data += BSIZE;
+    ndata--;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    blink(&bcache.bucket[i % NBUCKET], b);
+  }
+  if(i < MINNBUF)
+    panic("binit: out of memory");
+  bcache.nbuf = i;
+}
+
+// Look for block on device dev in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Return the least recently used unused buffer on bk, or 0.
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+// Caller must hold bk->lock.
+static struct buf*
+boldest(struct bucket *bk)
+{
+  struct buf *b, *old;
+
+  old = 0;
+  for(b = bk->head; b; b = b->next){
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0 &&
+       (old == 0 || b->lastuse < old->lastuse))
+      old = b;
   }
+  return old;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For read-ahead, return 0 instead if the block is
+// already cached or there is no buffer to spare.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  struct bucket *bk, *k, *best;
+  uint bestuse;
+  int i, n;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(ahead){
+      release(&bk->lock);
+      return 0;
+    }
+    b->refcnt++;
+    bk->hits++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached; recycle the least recently used unused buffer.
+  // Look again under bcache.lock, since another process may
+  // have brought the block in after we released bk->lock.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(ahead){
+      release(&bk->lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    bk->hits++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // Sweep the chains from bcache.hand, one lock at a time,
+  // until BSCAN of them have an unused buffer, and pick the
+  // chain whose oldest unused buffer is the least recently
+  // used.  A hit may take that buffer before the chain is
+  // locked again; then take the chain's oldest now, or sweep
+  // on if it has none left.
+  victim = 0;
+  do {
+    best = 0;
+    bestuse = 0;
+    for(i = 0, n = 0; i < NBUCKET && n < BSCAN; i++){
+      k = &bcache.bucket[bcache.hand];
+      bcache.hand = (bcache.hand + 1) % NBUCKET;
+      if(k != bk)
+        acquire(&k->lock);
+      if((b = boldest(k)) != 0){
+        n++;
+        if(best == 0 || b->lastuse < bestuse){
+          best = k;
+          bestuse = b->lastuse;
+        }
+      }
+      if(k != bk)
+        release(&k->lock);
+    }
+    if(best == 0)
+      break;
+    k = best;
+    if(k != bk)
+      acquire(&k->lock);
+    if((victim = boldest(k)) == 0 && k != bk)
+      release(&k->lock);
+  } while(victim == 0);
+  if(victim == 0){
+    if(ahead){
+      release(&bk->lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    panic("bget: no buffers");
+  }
+
+  if(k != bk){
+    bunlink(k, victim);
+    blink(bk, victim);
+    release(&k->lock);
   }
-  panic("bget: no buffers");
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->flags = 0;
+  victim->iodone = 0;
+  victim->refcnt = 1;
+  bk->misses++;
+  if(ahead){
+    bk->ahead++;
+    bcache.nahead++;
+  }
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -98,13 +302,52 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
     iderw(b);
   }
   return b;
 }
 
+// Start reading the indicated block into the cache
+// and return without waiting for the disk.
+// Does nothing if the block is already cached, or if a
+// quarter of the cache is already waiting for read-ahead.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if(bcache.nahead >= bcache.nbuf/4)
+    return;
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  b->iodone = bdone;
+  idesubmit(b);
+}
+
+// Called by the disk driver when the read started by
+// breadahead() has finished.  Release the buffer on
+// behalf of the process that started the read.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    b->lastuse = ticks;
+  release(&bk->lock);
+
+  acquire(&bcache.lock);
+  bcache.nahead--;
+  release(&bcache.lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +358,69 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Start writing b's contents to disk and return
+// without waiting.  Must be locked; the caller must
+// bwait() for the write before releasing b.
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  b->flags |= B_DIRTY;
+  idesubmit(b);
+}
+
+// Wait for a write started by bwritestart().
+void
+bwait(struct buf *b)
+{
+  iowait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Record the time of last use for recycling in bget().
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
+  }
+  release(&bk->lock);
+}
+
+// Number of buffers in the cache.
+int
+bcount(void)
+{
+  return bcache.nbuf;
+}
+
+// Report buffer cache size, hit/miss and read-ahead counts.
+void
+bstat(struct kstat *st)
+{
+  struct bucket *bk;
+
+  st->nbuf = bcache.nbuf;
+  st->bhits = st->bmisses = st->bahead = 0;
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++){
+    acquire(&bk->lock);
+    st->bhits += bk->hits;
+    st->bmisses += bk->misses;
+    st->bahead += bk->ahead;
+    release(&bk->lock);
   }
-  
-  release(&bcache.lock);
 }
 //PAGEBREAK!
 // Blank page.
-
@@ -0,0 +1,112 @@
+// Stress the buddy allocator with multi-page allocations in
+// fragmented memory.  Each of n workers repeatedly creates
+// NPIPE pipes, each with a buffer of 2^PIPEORDER pages,
+// touching a fresh heap page after each one, then closes the
+// pipes and keeps the heap pages, leaving holes between them.
+// Prints pipes made per tick, pipe() calls that failed, and
+// the free blocks of each order before, while the workers
+// still hold their heaps, and after they exit.
+// usage: buddybench [n]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+#define NITER 100
+#define NPIPE 6
+
+void
+report(char *when)
+{
+  struct kstat st;
+  int i, free, big;
+
+  if(kstat(&st) < 0){
+    printf(2, "buddybench: kstat failed\n");
+    exit();
+  }
+  free = big = 0;
+  printf(1, "%s: free blocks by order:", when);
+  for(i = 0; i < NORDER; i++){
+    printf(1, " %d", st.buddyfree[i]);
+    free += st.buddyfree[i] << i;
+    if(st.buddyfree[i])
+      big = i;
+  }
+  printf(1, "; %d pages free, %d cached, largest order %d\n",
+         free, st.kcached, big);
+}
+
+void
+worker(int out, int hold)
+{
+  int i, j, fail, fds[NPIPE][2];
+  char *a, c;
+
+  fail = 0;
+  for(i = 0; i < NITER; i++){
+    for(j = 0; j < NPIPE; j++){
+      if(pipe(fds[j]) < 0){
+        fds[j][0] = -1;
+        fail++;
+      }
+      if((a = sbrk(4096)) == (char*)-1){
+        printf(2, "buddybench: sbrk failed\n");
+        exit();
+      }
+      a[0] = 1;
+    }
+    for(j = 0; j < NPIPE; j++){
+      if(fds[j][0] < 0)
+        continue;
+      c = j;
+      if(write(fds[j][1], &c, 1) != 1 || read(fds[j][0], &c, 1) != 1 || c != j){
+        printf(2, "buddybench: pipe lost data\n");
+        exit();
+      }
+      close(fds[j][0]);
+      close(fds[j][1]);
+    }
+  }
+  write(out, &fail, sizeof(fail));
+  read(hold, &c, 1);  // returns when main closes the other end
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fail, total, start, t, fds[2], hold[2];
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  if(pipe(fds) < 0 || pipe(hold) < 0){
+    printf(2, "buddybench: pipe failed\n");
+    exit();
+  }
+  report("before");
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if(fork() == 0){
+      close(fds[0]);
+      close(hold[1]);
+      worker(fds[1], hold[0]);
+    }
+  }
+  close(fds[1]);
+  total = 0;
+  for(i = 0; i < n; i++)
+    if(read(fds[0], &fail, sizeof(fail)) == sizeof(fail))
+      total += fail;
+  t = uptime() - start;
+  report("fragmented");
+  close(hold[1]);
+  for(i = 0; i < n; i++)
+    wait();
+  report("after");
+  if(t == 0)
+    t = 1;
+  printf(1, "%d workers: %d pipes in %d ticks, %d pipes/100 ticks, %d failed\n",
+         n, n*NITER*NPIPE, t, n*NITER*NPIPE*100/t, total);
+  exit();
+}
@@ -4,10 +4,14 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse;     // ticks at last brelse, for LRU recycling
+  struct buf *prev; // hash bucket chain
   struct buf *next;
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  void (*iodone)(struct buf*); // if set, called when disk request finishes
+  uint qtick;       // ticks when queued, for the deadline scheduler
+  uint qstamp;      // rdtsck() when queued, for latency statistics
+  uchar *data;      // BSIZE bytes, allocated by binit()
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
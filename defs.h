@@ -2,6 +2,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kstat;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -13,8 +14,14 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            bstat(struct kstat*);
+int             bcount(void);
 
 // console.c
 void            consoleinit(void);
@@ -36,7 +43,9 @@ int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            fsstat(struct kstat*);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -46,6 +55,10 @@ void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             isdirempty(struct inode*);
+int             itextbusy(struct inode*);
+struct inode*   itextdup(struct inode*);
+void            itextput(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -57,6 +70,9 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            iowait(struct buf*);
+void            idestat(struct kstat*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,7 +81,16 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+int             kfreecount(void);
+int             kreserve(int);
+void            kunreserve(int);
 void            kfree(char*);
+void            kdup(char*);
+int             krefcount(char*);
+void            kown(char*, int);
+char*           kallocpages(int);
+void            kfreepages(char*, int);
+void            kmemstat(struct kstat*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -85,12 +110,24 @@ void            microdelay(int);
 void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+void            end_opn(int);
+int             log_maxop(void);
+void            logstat(struct kstat*);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint);
+void            pcput(struct inode*, uint);
+char*           pctext(struct inode*, uint);
+void            pcwrite(struct inode*, uint, char*, uint);
+void            pcpurge(struct inode*);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -108,6 +145,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -151,6 +189,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argrptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -179,12 +218,19 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+uint            mmapfloor(struct proc*);
+int             mmap(struct file*, uint, uint);
+int             munmap(uint, uint);
+void            munmapall(struct proc*);
+int             pagefault(uint, uint);
+int             mmapfault(uint, uint);
+int             uvmfault(uint, uint, int);
+uint            uvmabsent(pde_t*, uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,92 @@
+// Time name lookups in one large directory: link n names to
+// a file, open each name, open as many missing names, then
+// unlink them all, printing how many ticks each phase takes.
+// Build with HASHDIR=1 to compare hashed directories.
+// usage: dirbench [n]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "kstat.h"
+
+// Set name to c followed by the decimal digits of i.
+void
+mkname(char *name, char c, int i)
+{
+  char digits[10];
+  int n;
+
+  n = 0;
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  *name++ = c;
+  while(n > 0)
+    *name++ = digits[--n];
+  *name = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fd, t0, t1, t2, t3, t4;
+  char name[16];
+  struct kstat st;
+
+  n = argc > 1 ? atoi(argv[1]) : 10000;
+  if(mkdir("dbdir") < 0 || chdir("dbdir") < 0){
+    printf(2, "dirbench: cannot make dbdir\n");
+    exit();
+  }
+  if((fd = open("t", O_CREATE|O_RDWR)) < 0){
+    printf(2, "dirbench: cannot create t\n");
+    exit();
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, 'f', i);
+    if(link("t", name) < 0){
+      printf(2, "dirbench: link %s failed\n", name);
+      exit();
+    }
+  }
+  t1 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, 'f', i);
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf(2, "dirbench: open %s failed\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  t2 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, 'g', i);
+    if((fd = open(name, O_RDONLY)) >= 0){
+      printf(2, "dirbench: open %s worked\n", name);
+      exit();
+    }
+  }
+  t3 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, 'f', i);
+    if(unlink(name) < 0){
+      printf(2, "dirbench: unlink %s failed\n", name);
+      exit();
+    }
+  }
+  t4 = uptime();
+
+  unlink("t");
+  chdir("..");
+  unlink("dbdir");
+  printf(1, "%d names: link %d, lookup %d, lookup missing %d, unlink %d ticks\n",
+         n, t1 - t0, t2 - t1, t3 - t2, t4 - t3);
+  if(kstat(&st) == 0)
+    printf(1, "dcache: %d hits, %d misses\n", st.dchits, st.dcmisses);
+  exit();
+}
@@ -14,15 +14,27 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int ntext;          // Processes running this file; protected by icache.lock
+  struct inode *hnext; // icache hash chain
+  struct inode *lprev; // icache LRU list of unreferenced entries
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // offset where the last readi() ended
+  uint raend;         // first block not yet read ahead
+  uint rawin;         // read-ahead window, in blocks
+  uint xlbn;          // last extent bmap() used: first file block,
+  uint xstart;        //   first disk block,
+  uint xlen;          //   and length
+  uint bhint;         // block bmap() should try to allocate next
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint indirect[NLEVEL];
 };
 
 // table mapping major device number to
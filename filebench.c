@@ -0,0 +1,67 @@
+// Create and then delete many empty files in a fresh
+// directory, printing how many ticks each phase takes.
+// usage: filebench [nfiles]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "kstat.h"
+
+// Set name to "f" followed by the decimal digits of i.
+void
+mkname(char *name, int i)
+{
+  char digits[10];
+  int n;
+
+  n = 0;
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  *name++ = 'f';
+  while(n > 0)
+    *name++ = digits[--n];
+  *name = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fd, t0, t1, t2;
+  char name[16];
+  struct kstat st;
+
+  n = argc > 1 ? atoi(argv[1]) : 2000;
+  if(mkdir("fbdir") < 0 || chdir("fbdir") < 0){
+    printf(2, "filebench: cannot make fbdir\n");
+    exit();
+  }
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf(2, "filebench: create %s failed\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  t1 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    if(unlink(name) < 0){
+      printf(2, "filebench: unlink %s failed\n", name);
+      exit();
+    }
+  }
+  t2 = uptime();
+
+  chdir("..");
+  unlink("fbdir");
+  printf(1, "%d files: create %d ticks, delete %d ticks\n", n, t1 - t0, t2 - t1);
+  if(kstat(&st) == 0)
+    printf(1, "%d free blocks, %d free inodes\n", st.freeblocks, st.freeinodes);
+  exit();
+}
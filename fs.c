@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "kstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -51,29 +52,105 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The blocks are divided into groups of BGROUP, and bsum
+// keeps the number of free blocks in each group and in all,
+// counted from the bitmap at mount by bsuminit() and kept up
+// to date by balloc() and bfree().  balloc() uses the counts
+// to skip full groups without reading their bitmap blocks,
+// and starts its search at a goal block near the previous
+// allocation rather than at block 0.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define BGROUP 256  // blocks per group; divides BPB
+
+struct {
+  struct spinlock lock;
+  ushort *nfree;    // free blocks in each group
+  uint ngroup;
+  uint total;       // free blocks in all groups
+  uint rotor;       // group to search first when there is no goal
+} bsum;
+
+// Count the free blocks in each group.
+static void
+bsuminit(uint dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi;
 
-  bp = 0;
+  initlock(&bsum.lock, "bsum");
+  bsum.ngroup = (sb.size + BGROUP - 1) / BGROUP;
+  if(bsum.ngroup > PGSIZE / sizeof(ushort) || (bsum.nfree = (ushort*)kalloc()) == 0)
+    panic("bsuminit");
+  memset(bsum.nfree, 0, PGSIZE);
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+        bsum.nfree[(b + bi) / BGROUP]++;
+        bsum.total++;
       }
     }
     brelse(bp);
   }
+}
+
+// Mark a free block of group g in use: the first at or after
+// block from, which lies in g, else the first in the group.
+// Returns 0 if the group is full.
+static uint
+bgalloc(uint dev, uint g, uint from)
+{
+  struct buf *bp;
+  uint b, bi, m, i, start, n;
+
+  start = g * BGROUP;
+  n = sb.size - start < BGROUP ? sb.size - start : BGROUP;
+  bp = bread(dev, BBLOCK(start, sb));
+  for(i = 0; i < n; i++){
+    b = start + (from - start + i) % n;
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){  // Is block free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      acquire(&bsum.lock);
+      bsum.nfree[g]--;
+      bsum.total--;
+      release(&bsum.lock);
+      brelse(bp);
+      return b;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Allocate a zeroed disk block: goal if it is free, else the
+// next free block after it in its group, else a block in the
+// next group that has one.  Without a goal, continue from
+// the group of the last such allocation.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, g, n, nogoal;
+
+  if(bsum.total == 0)
+    panic("balloc: out of blocks");
+  nogoal = goal == 0 || goal >= sb.size;
+  if(nogoal)
+    goal = bsum.rotor * BGROUP;
+  g = goal / BGROUP;
+  for(n = 0; n < bsum.ngroup; n++){
+    if(bsum.nfree[g] > 0 && (b = bgalloc(dev, g, goal)) != 0){
+      if(nogoal)
+        bsum.rotor = g;
+      bzero(dev, b);
+      return b;
+    }
+    g = (g + 1) % bsum.ngroup;
+    goal = g * BGROUP;
+  }
   panic("balloc: out of blocks");
 }
 
@@ -91,6 +168,10 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BGROUP]++;
+  bsum.total++;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -124,13 +205,15 @@ bfree(int dev, uint b)
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. A free entry keeps its inode until
+//   iget() recycles it, least recently freed first, so an
+//   inode used again soon is found without a disk read.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -158,31 +241,296 @@ bfree(int dev, uint b)
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
+// Entries are found through a hash table on (dev, inum), and
+// free entries are kept on an LRU list; icache.lock protects
+// both, and with them ip->hnext, ip->lprev and ip->lnext.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 257
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  // Free entries, in a circular list through lprev/lnext.
+  // lru.lnext is the least recently freed.
+  struct inode lru;
 } icache;
 
+// Caller holds icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+}
+
+// Caller holds icache.lock.
+static void
+lruappend(struct inode *ip)
+{
+  ip->lnext = &icache.lru;
+  ip->lprev = icache.lru.lprev;
+  icache.lru.lprev->lnext = ip;
+  icache.lru.lprev = ip;
+}
+
+// Free-inode summary.
+//
+// isum keeps the number of free inodes in each inode block
+// and in all, counted at mount by isuminit() and kept up to
+// date by ialloc() and ifree().  ialloc() starts at isum.next,
+// the first inode block that may have a free inode, and
+// skips blocks whose count is zero without reading them.
+
+struct {
+  struct spinlock lock;
+  ushort *nfree;    // free inodes in each inode block
+  uint nblock;
+  uint total;       // free inodes in all blocks
+  uint next;        // no inode block before this one has a free inode
+} isum;
+
+// Count the free inodes in each inode block.
+static void
+isuminit(uint dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint ib, inum;
+
+  initlock(&isum.lock, "isum");
+  isum.nblock = (sb.ninodes + IPB - 1) / IPB;
+  if(isum.nblock > PGSIZE / sizeof(ushort) || (isum.nfree = (ushort*)kalloc()) == 0)
+    panic("isuminit");
+  memset(isum.nfree, 0, PGSIZE);
+  for(ib = 0; ib < isum.nblock; ib++){
+    bp = bread(dev, sb.inodestart + ib);
+    for(inum = ib*IPB; inum < (ib+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0){
+        isum.nfree[ib]++;
+        isum.total++;
+      }
+    }
+    brelse(bp);
+  }
+}
+
+// Count inode inum, just freed on disk, in the summary.
+static void
+ifree(uint inum)
+{
+  uint ib;
+
+  ib = inum / IPB;
+  acquire(&isum.lock);
+  isum.nfree[ib]++;
+  isum.total++;
+  if(ib < isum.next)
+    isum.next = ib;
+  release(&isum.lock);
+}
+
+// Directory name cache.
+//
+// dcache remembers the results of dirlookup(): the inum and
+// directory offset that name has in directory (dev, dinum),
+// or inum 0 if the name is known to be absent.  Entries are
+// hashed on (dev, dinum, name) and recycled least recently
+// used first.  A directory's entries change only with its
+// inode locked, so callers hold dp->lock: dirlookup() fills
+// the cache, and dirlink() and dirunlink() update it through
+// dcset() whenever they write a dirent.  iput() drops the
+// entries of a directory when it frees the inode, before the
+// inum can be reused, and dirsplit() when it moves dirents.
+
+#define NDENT  1024
+#define NDHASH 257
+
+struct dentry {
+  uint dev;
+  uint dinum;              // directory; 0 if entry unused
+  char name[DIRSIZ];
+  uint inum;               // 0 if name is not in the directory
+  uint off;                // offset of name's dirent
+  struct dentry *hnext;    // hash chain
+  struct dentry *lprev;    // LRU list
+  struct dentry *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDENT];
+  struct dentry *hash[NDHASH];
+  // All entries, in a circular list through lprev/lnext.
+  // lru.lnext is the least recently used.
+  struct dentry lru;
+  uint hits;
+  uint misses;
+} dcache;
+
+static uint
+dchash(uint dev, uint dinum, char *name)
+{
+  uint h, i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Move de to the most recently used end of the list.
+// Caller holds dcache.lock.
+static void
+dctouch(struct dentry *de)
+{
+  de->lnext->lprev = de->lprev;
+  de->lprev->lnext = de->lnext;
+  de->lnext = &dcache.lru;
+  de->lprev = dcache.lru.lprev;
+  dcache.lru.lprev->lnext = de;
+  dcache.lru.lprev = de;
+}
+
+// Remove de from its hash chain.
+// Caller holds dcache.lock.
+static void
+dcunhash(struct dentry *de)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dchash(de->dev, de->dinum, de->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == de){
+      *pp = de->hnext;
+      break;
+    }
+  }
+  de->dinum = 0;
+}
+
+// Caller holds dcache.lock.
+static struct dentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dentry *de;
+
+  for(de = dcache.hash[dchash(dp->dev, dp->inum, name)]; de; de = de->hnext)
+    if(de->dev == dp->dev && de->dinum == dp->inum &&
+       namecmp(de->name, name) == 0)
+      return de;
+  return 0;
+}
+
+static void
+dcinit(void)
+{
+  int i;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.lprev = dcache.lru.lnext = &dcache.lru;
+  for(i = 0; i < NDENT; i++){
+    dcache.ent[i].lprev = dcache.ent[i].lnext = &dcache.ent[i];
+    dctouch(&dcache.ent[i]);
+  }
+}
+
+// Look up name in directory dp in the cache.
+// If found, set *inum and *off and return 1.
+// Caller holds dp->lock.
+static int
+dcget(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  if((de = dcfind(dp, name)) == 0){
+    dcache.misses++;
+    release(&dcache.lock);
+    return 0;
+  }
+  dctouch(de);
+  dcache.hits++;
+  *inum = de->inum;
+  *off = de->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp has inode inum
+// and its dirent at off, or is absent if inum is 0.
+// Caller holds dp->lock.
+static void
+dcset(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  if((de = dcfind(dp, name)) == 0){
+    de = dcache.lru.lnext;
+    if(de->dinum)
+      dcunhash(de);
+    de->dev = dp->dev;
+    de->dinum = dp->inum;
+    strncpy(de->name, name, DIRSIZ);
+    de->hnext = dcache.hash[dchash(de->dev, de->dinum, de->name)];
+    dcache.hash[dchash(de->dev, de->dinum, de->name)] = de;
+  }
+  de->inum = inum;
+  de->off = off;
+  dctouch(de);
+  release(&dcache.lock);
+}
+
+// Forget the names in directory dp.
+static void
+dcpurge(struct inode *dp)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  for(de = dcache.ent; de < &dcache.ent[NDENT]; de++){
+    if(de->dinum == dp->inum && de->dev == dp->dev){
+      dcunhash(de);
+      // recycle it first
+      de->lnext->lprev = de->lprev;
+      de->lprev->lnext = de->lnext;
+      de->lnext = dcache.lru.lnext;
+      de->lprev = &dcache.lru;
+      dcache.lru.lnext->lprev = de;
+      dcache.lru.lnext = de;
+    }
+  }
+  release(&dcache.lock);
+}
+
 void
 iinit(int dev)
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
+  dcinit();
+  icache.lru.lprev = icache.lru.lnext = &icache.lru;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    lruappend(&icache.inode[i]);
   }
 
   readsb(dev, &sb);
+  if(sb.bsize != BSIZE)
+    panic("iinit: file system block size differs from BSIZE");
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
+ inodestart %d bmap start %d bsize %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+          sb.bmapstart, sb.bsize);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -195,18 +543,30 @@ struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
+  uint ib, start;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  start = isum.next;
+  for(ib = start; ib < isum.nblock; ib++){
+    if(isum.nfree[ib] == 0)
+      continue;
+    bp = bread(dev, sb.inodestart + ib);
+    for(inum = ib*IPB; inum < (ib+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        acquire(&isum.lock);
+        isum.nfree[ib]--;
+        isum.total--;
+        if(isum.next == start)  // no ifree() lowered it meanwhile
+          isum.next = ib;
+        release(&isum.lock);
+        brelse(bp);
+        return iget(dev, inum);
+      }
     }
     brelse(bp);
   }
@@ -230,7 +590,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  memmove(dip->indirect, ip->indirect, sizeof(ip->indirect));
   log_write(bp);
   brelse(bp);
 }
@@ -241,31 +602,38 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Recycle the least recently freed inode cache entry.
+  ip = icache.lru.lnext;
+  if(ip == &icache.lru)
     panic("iget: no inodes");
+  lruremove(ip);
+  if(ip->inum != 0){
+    for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
+  ip->hnext = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->raend = ip->rawin = 0;
   release(&icache.lock);
 
   return ip;
@@ -282,6 +650,40 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Like idup(), but also count ip as the program of a running
+// process, so that writei() refuses to change it.
+struct inode*
+itextdup(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->ref++;
+  ip->ntext++;
+  release(&icache.lock);
+  return ip;
+}
+
+// Drop a reference taken with itextdup().
+void
+itextput(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->ntext--;
+  release(&icache.lock);
+  iput(ip);
+}
+
+// Is ip the program of a running process?
+int
+itextbusy(struct inode *ip)
+{
+  int n;
+
+  acquire(&icache.lock);
+  n = ip->ntext;
+  release(&icache.lock);
+  return n > 0;
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -303,7 +705,10 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    memmove(ip->indirect, dip->indirect, sizeof(ip->indirect));
+    ip->xlen = 0;
+    ip->bhint = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -338,16 +743,21 @@ iput(struct inode *ip)
     release(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcpurge(ip);
+      pcpurge(ip);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
+      ifree(ip->inum);
       ip->valid = 0;
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    lruappend(ip);
   release(&icache.lock);
 }
 
@@ -363,40 +773,217 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in extents: runs of consecutive blocks on the disk, each
+// described by its first block and length. The extents map
+// the file's blocks in order. The first NEXTENT are listed
+// in ip->ext[].  The rest are listed in three trees of
+// extent blocks rooted at ip->indirect[0], [1] and [2]:
+// a single block of NINDIRECT extents, then one and two
+// levels of index blocks above such blocks.  An index block
+// entry's start is the block below it and its len the
+// number of file blocks mapped beneath it.  A zero-length
+// entry ends a block's list.
+//
+// bmap() remembers the last extent it used in ip->xlbn,
+// ip->xstart and ip->xlen, so mapping the blocks of a
+// sequential read or write rarely reads an extent block.
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Remember the extent of len blocks from disk block start,
+// which maps file blocks from lbn on, and return the disk
+// address of file block bn within it.
 static uint
-bmap(struct inode *ip, uint bn)
+xhit(struct inode *ip, uint lbn, uint start, uint len, uint bn)
+{
+  ip->xlbn = lbn;
+  ip->xstart = start;
+  ip->xlen = len;
+  return start + (bn - lbn);
+}
+
+// Look up file block bn in the tree of extent blocks at blk,
+// depth index levels above its leaves, whose first extent
+// maps file block *lbn.  Returns the disk address, or 0 with
+// *lbn advanced past the tree if bn lies beyond it.
+static uint
+xlookup(struct inode *ip, uint blk, int depth, uint *lbn, uint bn)
+{
+  struct buf *bp;
+  struct extent *x, e;
+  int i;
+
+  bp = bread(ip->dev, blk);
+  x = (struct extent*)bp->data;
+  for(i = 0; i < NINDIRECT && x[i].len > 0; i++){
+    if(bn < *lbn + x[i].len){
+      e = x[i];
+      brelse(bp);
+      if(depth == 0)
+        return xhit(ip, *lbn, e.start, e.len, bn);
+      return xlookup(ip, e.start, depth-1, lbn, bn);
+    }
+    *lbn += x[i].len;
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Copy the last extent in the tree at blk into *e.
+static void
+xlast(struct inode *ip, uint blk, int depth, struct extent *e)
+{
+  struct buf *bp;
+  struct extent *x;
+  int n;
+
+  bp = bread(ip->dev, blk);
+  x = (struct extent*)bp->data;
+  for(n = 0; n < NINDIRECT && x[n].len > 0; n++)
+    ;
+  *e = x[n-1];
+  brelse(bp);
+  if(depth > 0)
+    xlast(ip, e->start, depth-1, e);
+}
+
+// Grow the last extent in the tree at blk by one block.
+static void
+xgrow(struct inode *ip, uint blk, int depth)
 {
-  uint addr, *a;
   struct buf *bp;
+  struct extent *x;
+  int n;
+
+  bp = bread(ip->dev, blk);
+  x = (struct extent*)bp->data;
+  for(n = 0; n < NINDIRECT && x[n].len > 0; n++)
+    ;
+  if(depth > 0)
+    xgrow(ip, x[n-1].start, depth-1);
+  x[n-1].len++;
+  log_write(bp);
+  brelse(bp);
+}
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+// Append a one-block extent at disk block addr to the tree
+// at blk, adding extent blocks below blk as needed.
+// Returns 0 if the tree is full.
+static int
+xappend(struct inode *ip, uint blk, int depth, uint addr)
+{
+  struct buf *bp;
+  struct extent *x;
+  int n;
+
+  bp = bread(ip->dev, blk);
+  x = (struct extent*)bp->data;
+  for(n = 0; n < NINDIRECT && x[n].len > 0; n++)
+    ;
+  if(depth > 0 && n > 0 && xappend(ip, x[n-1].start, depth-1, addr)){
+    x[n-1].len++;
+  } else if(n == NINDIRECT){
+    brelse(bp);
+    return 0;
+  } else if(depth > 0){
+    x[n].start = balloc(ip->dev, addr);
+    x[n].len = 1;
+    xappend(ip, x[n].start, depth-1, addr);
+  } else {
+    x[n].start = addr;
+    x[n].len = 1;
   }
-  bn -= NDIRECT;
+  log_write(bp);
+  brelse(bp);
+  return 1;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, growing the
+// last extent when the new block follows it on the disk.
+// Returns 0 if the file has no room for another extent.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  uint addr, goal, lbn;
+  struct extent *e, last;
+  int k;
+
+  if(bn >= ip->xlbn && bn < ip->xlbn + ip->xlen)
+    return ip->xstart + (bn - ip->xlbn);
+
+  lbn = 0;
+  last.len = 0;
+  for(e = ip->ext; e < &ip->ext[NEXTENT] && e->len > 0; e++){
+    if(bn < lbn + e->len)
+      return xhit(ip, lbn, e->start, e->len, bn);
+    last = *e;
+    lbn += e->len;
+  }
+  for(k = 0; k < NLEVEL && ip->indirect[k]; k++)
+    if((addr = xlookup(ip, ip->indirect[k], k, &lbn, bn)) != 0)
+      return addr;
+
+  // Block bn is just past the end of the file.
+  if(bn != lbn)
+    panic("bmap: hole");
+  if(k > 0)
+    xlast(ip, ip->indirect[k-1], k-1, &last);
+  goal = ip->bhint;
+  if(goal == 0 && last.len > 0)
+    goal = last.start + last.len;
+  addr = balloc(ip->dev, goal);
+  ip->bhint = addr + 1;
+  if(last.len > 0 && addr == last.start + last.len){
+    if(k > 0)
+      xgrow(ip, ip->indirect[k-1], k-1);
+    else
+      e[-1].len++;
+    return xhit(ip, lbn - last.len, last.start, last.len + 1, bn);
+  }
+
+  // Start a new extent in the first unused slot.
+  if(k == 0 && e < &ip->ext[NEXTENT]){
+    e->start = addr;
+    e->len = 1;
+  } else if(k == 0 || !xappend(ip, ip->indirect[k-1], k-1, addr)){
+    if(k == NLEVEL){
+      bfree(ip->dev, addr);
+      return 0;
     }
-    brelse(bp);
-    return addr;
+    ip->indirect[k] = balloc(ip->dev, addr);
+    xappend(ip, ip->indirect[k], k, addr);
   }
+  return xhit(ip, lbn, addr, 1, bn);
+}
 
-  panic("bmap: out of range");
+// Free the len blocks from disk block start.
+static void
+xfree(uint dev, uint start, uint len)
+{
+  uint i;
+
+  for(i = 0; i < len; i++)
+    bfree(dev, start + i);
+}
+
+// Free the tree of extent blocks at blk, depth index
+// levels above its leaves, and every block it maps.
+static void
+xtrunc(uint dev, uint blk, int depth)
+{
+  struct buf *bp;
+  struct extent *x;
+  int i;
+
+  bp = bread(dev, blk);
+  x = (struct extent*)bp->data;
+  for(i = 0; i < NINDIRECT && x[i].len > 0; i++){
+    if(depth > 0)
+      xtrunc(dev, x[i].start, depth-1);
+    else
+      xfree(dev, x[i].start, x[i].len);
+  }
+  brelse(bp);
+  bfree(dev, blk);
 }
 
 // Truncate inode (discard contents).
@@ -407,29 +994,23 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  for(i = 0; i < NEXTENT; i++){
+    xfree(ip->dev, ip->ext[i].start, ip->ext[i].len);
+    ip->ext[i].start = 0;
+    ip->ext[i].len = 0;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->indirect[i]){
+      xtrunc(ip->dev, ip->indirect[i], i);
+      ip->indirect[i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
+  ip->xlen = 0;
+  ip->bhint = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -446,7 +1027,62 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Report free blocks and inodes.
+void
+fsstat(struct kstat *st)
+{
+  acquire(&bsum.lock);
+  st->freeblocks = bsum.total;
+  release(&bsum.lock);
+  acquire(&isum.lock);
+  st->freeinodes = isum.total;
+  release(&isum.lock);
+  acquire(&dcache.lock);
+  st->dchits = dcache.hits;
+  st->dcmisses = dcache.misses;
+  release(&dcache.lock);
+}
+
 //PAGEBREAK!
+// Sequential read-ahead.
+// A read that starts where the previous read of ip ended
+// doubles ip's read-ahead window, up to RAMAX blocks; any
+// other read halves it.  Start reading the rest of this
+// read's blocks, and the window beyond them, into the
+// buffer cache without waiting for the disk.
+// Caller must hold ip->lock.
+#define RAMIN 4
+
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, nb;
+
+  if(off == ip->ranext){
+    ip->rawin = ip->rawin ? ip->rawin*2 : RAMIN;
+    if(ip->rawin > RAMAX)
+      ip->rawin = RAMAX;
+  } else {
+    ip->rawin /= 2;
+    ip->raend = 0;
+  }
+  ip->ranext = off + n;
+  if(ip->rawin == 0)
+    return;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  bn = off/BSIZE + 1;
+  if(bn < ip->raend)
+    bn = ip->raend;
+  end = (off + n - 1)/BSIZE + 1 + ip->rawin;
+  if(end > nb)
+    end = nb;
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 int
@@ -471,6 +1107,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
+    if(tot == 0)
+      readahead(ip, off, n);
   }
   return n;
 }
@@ -481,7 +1119,7 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -492,22 +1130,25 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(itextbusy(ip))
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;  // file has run out of extents
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
+    pcwrite(ip, off, (char*)bp->data + off%BSIZE, m);
     log_write(bp);
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot > 0 || n == 0 ? tot : -1;
 }
 
 //PAGEBREAK!
@@ -519,6 +1160,188 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories; see the comment at DIRHASH in fs.h.
+// Callers hold dp->lock.
+
+#define DHEAD(bp)  ((struct dirhead*)(bp)->data + 2)
+#define DTRAIL(bp) ((struct dirpage*)(bp)->data + DPE)
+
+// Address of table entry i in block 0.
+static ushort*
+dtent(struct buf *bp, uint i)
+{
+  return &((struct dirtab*)bp->data + 3 + i/DTPS)->page[i%DTPS];
+}
+
+static int
+isdots(char *name)
+{
+  return namecmp(name, ".") == 0 || namecmp(name, "..") == 0;
+}
+
+// Append a zeroed page to dp and return its block number
+// within dp, or 0 if the disk or the file is full.
+static uint
+dirgrow(struct inode *dp)
+{
+  uint pg;
+
+  pg = dp->size / BSIZE;
+  if(pg > 0xFFFF || bmap(dp, pg) == 0)
+    return 0;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return pg;
+}
+
+// Lay out empty hashed directory dp: block 0 and one page.
+static int
+dirinit(struct inode *dp)
+{
+  struct buf *bp;
+
+  if(dirgrow(dp) != 0 || dirgrow(dp) != 1)
+    return -1;
+  bp = bread(dp->dev, bmap(dp, 0));
+  DHEAD(bp)->depth = 0;
+  DHEAD(bp)->count = 0;
+  *dtent(bp, 0) = 1;
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Look for name in hashed directory dp.
+// If found, set *poff and return its inum; else return 0.
+static uint
+hdirlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint pg, i, inum;
+
+  bp = bread(dp->dev, bmap(dp, 0));
+  pg = *dtent(bp, dirhash(name) & ((1 << DHEAD(bp)->depth) - 1));
+  brelse(bp);
+  while(pg){
+    bp = bread(dp->dev, bmap(dp, pg));
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPE; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        inum = de[i].inum;
+        *poff = pg*BSIZE + i*sizeof(*de);
+        brelse(bp);
+        return inum;
+      }
+    }
+    pg = DTRAIL(bp)->next;
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Split page pg, whose names all share its depth low hash bits,
+// on the next bit, doubling the table first if no entry is left
+// to point at the new page.  hbp holds block 0.
+static int
+dirsplit(struct inode *dp, struct buf *hbp, uint pg)
+{
+  struct buf *bp, *nbp;
+  struct dirent *de, *nde;
+  uint d, i, j, n, npg;
+
+  bp = bread(dp->dev, bmap(dp, pg));
+  d = DTRAIL(bp)->depth;
+  if(d == DHEAD(hbp)->depth){
+    if(d == DMAXDEPTH || (npg = dirgrow(dp)) == 0){
+      brelse(bp);
+      return -1;
+    }
+    n = 1 << d;
+    for(i = 0; i < n; i++)
+      *dtent(hbp, n + i) = *dtent(hbp, i);
+    DHEAD(hbp)->depth++;
+  } else if((npg = dirgrow(dp)) == 0){
+    brelse(bp);
+    return -1;
+  }
+
+  nbp = bread(dp->dev, bmap(dp, npg));
+  de = (struct dirent*)bp->data;
+  nde = (struct dirent*)nbp->data;
+  for(i = j = 0; i < DPE; i++){
+    if(de[i].inum != 0 && (dirhash(de[i].name) >> d) & 1){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  DTRAIL(bp)->depth = DTRAIL(nbp)->depth = d + 1;
+  n = 1 << DHEAD(hbp)->depth;
+  for(i = 0; i < n; i++)
+    if(*dtent(hbp, i) == pg && (i >> d) & 1)
+      *dtent(hbp, i) = npg;
+  log_write(bp);
+  log_write(nbp);
+  log_write(hbp);
+  brelse(nbp);
+  brelse(bp);
+  dcpurge(dp);  // offsets of the moved names are stale
+  return 0;
+}
+
+// Add name to hashed directory dp.
+// Returns the offset of its dirent, or -1 if dp cannot grow.
+static int
+hdirlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *hbp, *bp;
+  struct dirent *de;
+  uint h, first, pg, last, i, off;
+  int split;
+
+  hbp = bread(dp->dev, bmap(dp, 0));
+  h = dirhash(name);
+  for(split = 0; ; split = 1){
+    first = *dtent(hbp, h & ((1 << DHEAD(hbp)->depth) - 1));
+    // Look for an empty dirent in the page and its overflow pages.
+    for(pg = last = first; pg; pg = DTRAIL(bp)->next, brelse(bp)){
+      last = pg;
+      bp = bread(dp->dev, bmap(dp, pg));
+      de = (struct dirent*)bp->data;
+      for(i = 0; i < DPE; i++)
+        if(de[i].inum == 0)
+          goto found;
+    }
+    // All full.  Split the page, once, unless it has overflowed.
+    if(split || last != first || dirsplit(dp, hbp, first) < 0)
+      break;
+  }
+
+  // Chain a new overflow page to the last one.
+  if((pg = dirgrow(dp)) == 0){
+    brelse(hbp);
+    return -1;
+  }
+  bp = bread(dp->dev, bmap(dp, last));
+  DTRAIL(bp)->next = pg;
+  log_write(bp);
+  brelse(bp);
+  bp = bread(dp->dev, bmap(dp, pg));
+  de = (struct dirent*)bp->data;
+  i = 0;
+
+found:
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  off = pg*BSIZE + i*sizeof(*de);
+  log_write(bp);
+  brelse(bp);
+  DHEAD(hbp)->count++;
+  log_write(hbp);
+  brelse(hbp);
+  return off;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -530,6 +1353,25 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcget(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dp->major == DIRHASH && !isdots(name)){
+    if((inum = hdirlookup(dp, name, &off)) == 0){
+      dcset(dp, name, 0, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = off;
+    dcset(dp, name, inum, off);
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -540,10 +1382,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcset(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcset(dp, name, 0, 0);
   return 0;
 }
 
@@ -561,6 +1405,17 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->major == DIRHASH){
+    if(dp->size == 0 && dirinit(dp) < 0)
+      return -1;
+    if(!isdots(name)){
+      if((off = hdirlink(dp, name, inum)) < 0)
+        return -1;
+      dcset(dp, name, inum, off);
+      return 0;
+    }
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -573,10 +1428,54 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcset(dp, name, inum, off);
 
   return 0;
 }
 
+// Remove name, whose dirent is at offset off, from directory dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+  struct buf *bp;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink");
+  if(dp->major == DIRHASH){
+    bp = bread(dp->dev, bmap(dp, 0));
+    DHEAD(bp)->count--;
+    log_write(bp);
+    brelse(bp);
+  }
+  dcset(dp, name, 0, 0);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int
+isdirempty(struct inode *dp)
+{
+  int off;
+  uint n;
+  struct dirent de;
+  struct buf *bp;
+
+  if(dp->major == DIRHASH){
+    bp = bread(dp->dev, bmap(dp, 0));
+    n = DHEAD(bp)->count;
+    brelse(bp);
+    return n == 0;
+  }
+  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+      panic("isdirempty: readi");
+    if(de.inum != 0)
+      return 0;
+  }
+  return 1;
+}
+
 //PAGEBREAK!
 // Paths
 
@@ -3,7 +3,12 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 1024  // block size: 512, 1024, 2048 or 4096
+#endif
+#if BSIZE < 512 || BSIZE > 4096 || (BSIZE & (BSIZE - 1))
+#error "BSIZE must be a power of two from 512 to 4096"
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -15,15 +20,32 @@ struct superblock {
   uint size;         // Size of file system image (blocks)
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
-  uint nlog;         // Number of log blocks
+  uint nlog;         // Number of log blocks, header included
+  uint nloghead;     // Number of log header blocks
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size in bytes
 };
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// Log header blocks needed to describe n logged blocks: a count
+// followed by n block numbers.
+#define LOGHDRSIZE(n) ((n) / (BSIZE / sizeof(uint)) + 1)
+
+// A run of consecutive disk blocks holding consecutive
+// blocks of a file.
+struct extent {
+  uint start;        // First disk block
+  uint len;          // Number of blocks; 0 marks an unused slot
+};
+
+#define NEXTENT 5
+#define NINDIRECT (BSIZE / sizeof(struct extent))
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define NLEVEL 3   // single, double and triple indirect
+// Blocks any file can hold, however fragmented.
+#define MAXFILE (NEXTENT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +54,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];   // Data block extents
+  uint indirect[NLEVEL];  // Single, double and triple indirect blocks
 };
 
 // Inodes per block.
@@ -55,3 +78,51 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Hashed directories.
+//
+// A directory whose inode has major == DIRHASH is a hash table
+// instead of a flat array of dirents.  Block 0 holds "." and
+// "..", a struct dirhead and the table, which maps the low
+// depth bits of a name's dirhash() to the block (page) that
+// holds the name.  Every other block is a page of DPE dirents
+// and a struct dirpage.  A full page splits in two, doubling
+// the table if it must (extendible hashing); once it cannot,
+// the page chains to an overflow page.  The header, table and
+// trailers all begin with inum 0, so the directory still reads
+// as an array of dirents.
+#define DIRHASH 1
+
+struct dirhead {     // dirent slot 2 of block 0
+  ushort inum;       // 0
+  ushort depth;      // table has 1<<depth entries
+  uint count;        // names other than . and ..
+  uint pad[2];
+};
+
+#define DTPS 7       // table entries per dirent slot
+struct dirtab {      // dirent slots 3.. of block 0
+  ushort inum;       // 0
+  ushort page[DTPS];
+};
+
+struct dirpage {     // last dirent slot of each page
+  ushort inum;       // 0
+  ushort depth;      // low hash bits shared by this page's names
+  uint next;         // overflow page, or 0
+  uint pad[2];
+};
+
+#define DPE (BSIZE / sizeof(struct dirent) - 1)  // dirents per page
+// Largest table depth whose entries fit in block 0.
+#define DMAXDEPTH (BSIZE >= 4096 ? 10 : BSIZE >= 2048 ? 9 : BSIZE >= 1024 ? 8 : 7)
+
+static inline uint
+dirhash(char *name)
+{
+  uint h, i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
@@ -7,11 +7,37 @@
 char buf[1024];
 int match(char*, char*);
 
+// Lines end in newlines when grep scans a mapped file in place.
+#define END(c) ((c) == '\0' || (c) == '\n')
+
+// Scan the n bytes of a file mapped at p.
+void
+grepmap(char *pattern, char *p, int n)
+{
+  char *q, *e;
+
+  e = p + n;
+  for(; p < e; p = q+1){
+    for(q = p; q < e && *q != '\n'; q++)
+      ;
+    if(q < e && match(pattern, p))
+      write(1, p, q+1 - p);
+  }
+}
+
 void
 grep(char *pattern, int fd)
 {
   int n, m;
   char *p, *q;
+  struct stat st;
+
+  if(fstat(fd, &st) == 0 && st.type == T_FILE && st.size > 0 &&
+     (p = mmap(fd, 0, st.size)) != (char*)-1){
+    grepmap(pattern, p, st.size);
+    munmap(p, st.size);
+    return;
+  }
 
   m = 0;
   while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
@@ -77,7 +103,7 @@ match(char *re, char *text)
   do{  // must look at empty string
     if(matchhere(re, text))
       return 1;
-  }while(*text++ != '\0');
+  }while(!END(*text++));
   return 0;
 }
 
@@ -89,8 +115,8 @@ int matchhere(char *re, char *text)
   if(re[1] == '*')
     return matchstar(re[0], re+2, text);
   if(re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if(*text!='\0' && (re[0]=='.' || re[0]==*text))
+    return END(*text);
+  if(!END(*text) && (re[0]=='.' || re[0]==*text))
     return matchhere(re+1, text+1);
   return 0;
 }
@@ -101,7 +127,7 @@ int matchstar(int c, char *re, char *text)
   do{  // a * matches zero or more instances
     if(matchhere(re, text))
       return 1;
-  }while(*text!='\0' && (*text++==c || c=='.'));
+  }while(!END(*text) && (*text++==c || c=='.'));
   return 0;
 }
 
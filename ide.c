@@ -12,6 +12,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,15 +24,52 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+
+#define IDE_MULT      16  // sectors per READ/WRITE MULTIPLE data block
+
+// Disk schedulers, see IOSCHED in param.h.
+#define IOSCHED_NOOP     0
+#define IOSCHED_CLOOK    1
+#define IOSCHED_DEADLINE 2
+
+#define READ_EXPIRE   50  // deadline for reads, in ticks
+#define WRITE_EXPIRE 500  // deadline for writes, in ticks
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// iderw() queues a request and sleeps until it is done.
+// idesubmit() only queues it, so a caller can put several
+// requests on the queue back to back and then iowait() for
+// each of them.  If b->iodone is set, ideintr() calls it
+// (with idelock held, so it must not sleep) instead of waking
+// up waiters; the callback then owns the buffer.
+//
+// idestart() merges the bufs at the head of the queue that
+// continue one run of blocks in the same direction into a
+// single READ/WRITE MULTIPLE command of up to idemult sectors.
+// idenbuf is the number of bufs in the active command.
+//
+// The order of the rest of the queue is up to the scheduler:
+// * noop appends new requests, so the disk sees them in FIFO order.
+// * C-LOOK keeps the queue sorted in one upward sweep from
+//   the block the disk is working on, wrapping around once.
+// * deadline sorts like C-LOOK, but before each command moves
+//   the oldest request that has waited longer than its expiry
+//   time to the front, so a sweep cannot starve it.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
 
 static int havedisk1;
+static int idemult = IDE_MULT;  // 1 if multiple mode is off
+static int idenbuf;
+static int iosched = IOSCHED;
+static uint idepos;  // block after the last one transferred
+static uint idecmds, ideblocks, ideseek;
+static uint iohist[2][NIOHIST];  // latency of reads, writes
 static void idestart(struct buf*);
 
 // Wait for IDE disk to become ready.
@@ -65,79 +103,179 @@ ideinit(void)
     }
   }
 
+  // Ask the disks to transfer IDE_MULT sectors per data
+  // block, so one multi-block command raises one interrupt.
+  // If a disk refuses, READ/WRITE MULTIPLE cannot be used:
+  // fall back to single-sector commands, which only work
+  // for one-sector blocks and cannot be merged.
+  outb(0x3f6, 2);  // no interrupts
+  for(i = 0; i <= havedisk1; i++){
+    outb(0x1f6, 0xe0 | (i<<4));
+    idewait(0);
+    outb(0x1f2, IDE_MULT);
+    outb(0x1f7, IDE_CMD_SETMUL);
+    if(idewait(1) < 0)
+      idemult = 1;
+  }
+  outb(0x3f6, 0);
+  if(idemult == 1 && BSIZE > SECTOR_SIZE)
+    panic("ideinit: no multiple mode for BSIZE > 512");
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the request for b, together with the bufs queued
+// right behind it that continue its run of blocks in the
+// same direction.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *p, *q;
+  int i, n;
+
   if(b == 0)
     panic("idestart");
   if(b->blockno >= FSSIZE)
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7) panic("idestart");
+  if (sector_per_block > idemult) panic("idestart");
+
+  n = 1;
+  for(p = b; (q = p->qnext) != 0 && (n+1)*sector_per_block <= idemult; p = q){
+    if(q->dev != b->dev || q->blockno != p->blockno + 1 ||
+       (q->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+    n++;
+  }
+  idenbuf = n;
+  idecmds++;
+  ideblocks += n;
+  ideseek += b->blockno > idepos ? b->blockno - idepos : idepos - b->blockno;
+  idepos = b->blockno + n;
+
+  int nsector = n * sector_per_block;
+  // nsector > 1 only if the disks accepted multiple mode.
+  int read_cmd = (nsector == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
+  int write_cmd = (nsector == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsector);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    for(i = 0, p = b; i < n; i++, p = p->qnext)
+      outsl(0x1f0, p->data, BSIZE/4);
   } else {
     outb(0x1f7, read_cmd);
   }
 }
 
+// Sort key of b for C-LOOK, when the disk is at block pos.
+// Blocks below pos wrap around to the end of the sweep.
+static uint
+iokey(struct buf *b, uint pos)
+{
+  return b->blockno - pos;
+}
+
+// Deadline scheduler: move the oldest expired request,
+// if any, to the front of the queue.  Caller must hold
+// idelock, and the disk must be idle.
+static void
+ioexpire(void)
+{
+  struct buf **pp, **oldest, *b;
+  uint age, expire;
+
+  if(iosched != IOSCHED_DEADLINE)
+    return;
+  oldest = 0;
+  for(pp = &idequeue; *pp; pp = &(*pp)->qnext){
+    age = ticks - (*pp)->qtick;
+    expire = ((*pp)->flags & B_DIRTY) ? WRITE_EXPIRE : READ_EXPIRE;
+    if(age >= expire && (oldest == 0 || (*pp)->qtick < (*oldest)->qtick))
+      oldest = pp;
+  }
+  if(oldest == 0 || *oldest == idequeue)
+    return;
+  b = *oldest;
+  *oldest = b->qnext;
+  b->qnext = idequeue;
+  idequeue = b;
+}
+
+// Record how long b took, from queueing to completion.
+static void
+iolatency(struct buf *b)
+{
+  uint t;
+  int i;
+
+  t = (rdtsck() - b->qstamp) >> 1;
+  for(i = 0; t && i < NIOHIST-1; i++)
+    t >>= 1;
+  iohist[(b->flags & B_DIRTY) != 0][i]++;
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *p;
+  void (*done)(struct buf*);
+  int i;
 
-  // First queued buffer is the active request.
+  // First idenbuf queued buffers are the active request.
   acquire(&idelock);
 
   if((b = idequeue) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
   // Read data if needed.
   if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+    for(i = 0, p = b; i < idenbuf; i++, p = p->qnext)
+      insl(0x1f0, p->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs,
+  // or hand them to their completion callbacks.
+  for(i = 0; i < idenbuf; i++){
+    b = idequeue;
+    idequeue = b->qnext;
+    iolatency(b);
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if((done = b->iodone) != 0){
+      b->iodone = 0;
+      done(b);
+    } else
+      wakeup(b);
+  }
 
   // Start disk on next buf in queue.
-  if(idequeue != 0)
+  if(idequeue != 0){
+    ioexpire();
     idestart(idequeue);
+  }
 
   release(&idelock);
 }
 
-//PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
-iderw(struct buf *b)
+// Insert b into idequeue and start the disk if it is idle.
+// Caller must hold idelock.
+static void
+idequeue_insert(struct buf *b)
 {
-  struct buf **pp;
+  struct buf **pp, *last;
+  int i;
 
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
@@ -146,23 +284,82 @@ iderw(struct buf *b)
   if(b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
-  acquire(&idelock);  //DOC:acquire-lock
+  b->qtick = ticks;
+  b->qstamp = rdtsck();
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
+  // Skip the bufs the disk is working on, then
+  // find b's place according to the scheduler.
+  last = 0;
+  pp = &idequeue;
+  for(i = 0; i < idenbuf && *pp; i++){
+    last = *pp;
+    pp = &(*pp)->qnext;
+  }
+  if(iosched == IOSCHED_NOOP || last == 0){
+    while(*pp)  //DOC:insert-queue
+      pp = &(*pp)->qnext;
+  } else {
+    while(*pp && iokey(*pp, last->blockno) <= iokey(b, last->blockno))
+      pp = &(*pp)->qnext;
+  }
+  b->qnext = *pp;
   *pp = b;
 
   // Start disk if necessary.
   if(idequeue == b)
     idestart(b);
+}
+
+//PAGEBREAK!
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  acquire(&idelock);  //DOC:acquire-lock
+
+  idequeue_insert(b);
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
 
+  release(&idelock);
+}
+
+// Queue b for the disk like iderw(), but return
+// without waiting for the request to finish.
+void
+idesubmit(struct buf *b)
+{
+  acquire(&idelock);
+  idequeue_insert(b);
+  release(&idelock);
+}
+
+// Wait for a request queued by idesubmit() to finish.
+// Must not be used on a buf that has an iodone callback.
+void
+iowait(struct buf *b)
+{
+  acquire(&idelock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &idelock);
+  release(&idelock);
+}
 
+// Report disk command, seek and latency statistics.
+void
+idestat(struct kstat *st)
+{
+  acquire(&idelock);
+  st->idecmds = idecmds;
+  st->ideblocks = ideblocks;
+  st->iosched = iosched;
+  st->ideseek = ideseek;
+  memmove(st->ioread, iohist[0], sizeof(st->ioread));
+  memmove(st->iowrite, iohist[1], sizeof(st->iowrite));
   release(&idelock);
 }
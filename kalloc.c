@@ -1,13 +1,42 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, and blocks of
+// 2^order physically contiguous pages.
+//
+// Free memory is held by a buddy allocator, as blocks of
+// 2^order pages aligned to their size, on one free list per
+// order.  kallocpages() splits a larger block when no block
+// of the order asked for is free, and kfreepages() merges a
+// freed block with its buddy, the other half of the block of
+// the next order, for as long as the buddy is free too.
+//
+// Single pages are cached on per-CPU free lists in front of
+// the buddy allocator, so that kalloc() and kfree() on
+// different CPUs do not contend for one lock.  A CPU whose
+// list runs dry takes a batch of pages from the buddy
+// allocator, or failing that steals a batch from the CPU with
+// the most free pages; a list that grows past KCACHE pages
+// gives a batch back.
+//
+// Every page has a struct page in pages[], indexed by physical
+// page number, holding a reference count, flags and the use
+// the page was allocated for.  The reference count lets page
+// tables share pages (copy-on-write fork): kalloc() sets it
+// to 1, kdup() adds a reference, and kfree() drops one and
+// frees the page only when none are left.  The counts are
+// updated with atomic instructions rather than under a lock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
+#include "kstat.h"
+
+#define KSTEAL 32  // max pages moved by one steal
+#define KCACHE 64  // max pages on a CPU's list
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,22 +46,69 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
-  int use_lock;
   struct run *freelist;
-} kmem;
+  int nfree;           // number of pages on freelist
+};
+
+#define PF_FREE  0x1  // free
+#define PF_BUDDY 0x2  // first page of a block on a buddy free list
+
+struct page {
+  ushort ref;          // references; 0 if free
+  uchar flags;         // PF_*
+  uchar owner;         // PG_* in kstat.h
+  uchar order;         // of the block the page starts, if any
+};
+
+// A free block of the buddy allocator.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct kmem kmem[NCPU];
+static int kmem_use_lock;
+
+// Pages promised to processes but not allocated yet: heap
+// pages reserved by sbrk() and program pages that exec()
+// leaves to be faulted in.
+struct {
+  struct spinlock lock;
+  int n;
+} kresv;
+
+struct {
+  struct spinlock lock;
+  struct block free[NORDER];  // circular lists of free blocks
+  int nfree[NORDER];
+} buddy;
+
+// Entries below end, for the kernel itself, are unused.
+static struct page pages[PHYSTOP/PGSIZE];
+
+#define PAGE(v) (&pages[V2P(v)/PGSIZE])
 
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until kinit2() every page goes on CPU 0's list, since
+// cpuid() cannot be used before mpinit().
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem");
-  kmem.use_lock = 0;
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&kresv.lock, "kresv");
+  for(i = 0; i < NORDER; i++)
+    buddy.free[i].next = buddy.free[i].prev = &buddy.free[i];
+  kmem_use_lock = 0;
   freerange(vstart, vend);
 }
 
@@ -40,7 +116,7 @@ void
 kinit2(void *vstart, void *vend)
 {
   freerange(vstart, vend);
-  kmem.use_lock = 1;
+  kmem_use_lock = 1;
 }
 
 void
@@ -48,32 +124,380 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    PAGE(p)->ref = 1;
     kfree(p);
+  }
+}
+
+//PAGEBREAK!
+// Buddy allocator.  Callers hold buddy.lock, once
+// kmem_use_lock is set.
+
+static void
+bpush(char *v, int order)
+{
+  struct block *b, *head;
+
+  b = (struct block*)v;
+  head = &buddy.free[order];
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  buddy.nfree[order]++;
+  PAGE(v)->flags = PF_FREE | PF_BUDDY;
+  PAGE(v)->order = order;
+}
+
+static void
+bremove(char *v, int order)
+{
+  struct block *b;
+
+  b = (struct block*)v;
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[order]--;
+  PAGE(v)->flags = PF_FREE;
+}
+
+// Take a free block of 2^order pages, splitting a larger
+// one if need be.  Returns 0 if there is none.
+static char*
+buddyalloc(int order)
+{
+  char *v;
+  int k;
+
+  for(k = order; k < NORDER && buddy.nfree[k] == 0; k++)
+    ;
+  if(k == NORDER)
+    return 0;
+  v = (char*)buddy.free[k].next;
+  bremove(v, k);
+  // Keep the lower half, free the upper half.
+  while(k > order){
+    k--;
+    bpush(v + (PGSIZE << k), k);
+  }
+  return v;
+}
+
+// Free the block of 2^order pages at v, merging it with its
+// buddy while the buddy is a free block of the same order.
+static void
+buddyfree(char *v, int order)
+{
+  char *b;
+
+  for(; order < NORDER-1; order++){
+    b = P2V(V2P(v) ^ (PGSIZE << order));
+    if(V2P(b) >= PHYSTOP || PAGE(b)->flags != (PF_FREE | PF_BUDDY) ||
+       PAGE(b)->order != order)
+      break;
+    bremove(b, order);
+    if(b < v)
+      v = b;
+  }
+  bpush(v, order);
+}
+
+//PAGEBREAK!
+// Return the free list of the current CPU.
+// The caller may migrate to another CPU right after;
+// that is harmless, every list is protected by its own lock.
+static struct kmem*
+mykmem(void)
+{
+  int id;
+
+  if(!kmem_use_lock)
+    return &kmem[0];
+  pushcli();
+  id = cpuid();
+  popcli();
+  return &kmem[id];
+}
+
+// Remove up to n pages from km's list.
+// Returns them as a chain and sets *tail to its last page.
+static struct run*
+ktake(struct kmem *km, int n, struct run **tail, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = r = km->freelist;
+  for(i = 0; r && i < n; i++){
+    *tail = r;
+    r = r->next;
+  }
+  if(i > 0)
+    (*tail)->next = 0;
+  km->freelist = r;
+  km->nfree -= i;
+  *got = i;
+  return i > 0 ? head : 0;
+}
+
+// Push the chain head..tail of n pages onto km's list.
+static void
+kput(struct kmem *km, struct run *head, struct run *tail, int n)
+{
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+}
+
+// Give n pages from km's list back to the buddy allocator.
+static void
+kgive(struct kmem *km, int n)
+{
+  struct run *r, *next, *tail;
+  int got;
+
+  if(kmem_use_lock)
+    acquire(&km->lock);
+  r = ktake(km, n, &tail, &got);
+  if(kmem_use_lock){
+    release(&km->lock);
+    acquire(&buddy.lock);
+  }
+  for(; r; r = next){
+    next = r->next;
+    buddyfree((char*)r, 0);
+  }
+  if(kmem_use_lock)
+    release(&buddy.lock);
 }
+
+// Move a batch of pages from the buddy allocator to the list
+// of km.  Returns the number of pages moved.
+static int
+krefill(struct kmem *km)
+{
+  struct run *head, *tail, *r;
+  int n;
+
+  head = tail = 0;
+  if(kmem_use_lock)
+    acquire(&buddy.lock);
+  for(n = 0; n < KCACHE/2 && (r = (struct run*)buddyalloc(0)) != 0; n++){
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  if(kmem_use_lock)
+    release(&buddy.lock);
+  if(n == 0)
+    return 0;
+
+  if(kmem_use_lock)
+    acquire(&km->lock);
+  kput(km, head, tail, n);
+  if(kmem_use_lock)
+    release(&km->lock);
+  return n;
+}
+
+// Give the pages on every CPU's list back to the buddy
+// allocator, so that they can merge into larger blocks.
+static void
+kdrain(void)
+{
+  struct kmem *k;
+
+  for(k = kmem; k < &kmem[NCPU]; k++)
+    if(k->nfree > 0)
+      kgive(k, k->nfree);
+}
+
+// Take a batch of pages, up to half, from victim's list.
+// Returns them as a chain, as ktake() does.
+static struct run*
+ksteal1(struct kmem *victim, struct run **tail, int *got)
+{
+  struct run *head;
+  int n;
+
+  acquire(&victim->lock);
+  n = (victim->nfree + 1) / 2;
+  if(n > KSTEAL)
+    n = KSTEAL;
+  head = ktake(victim, n, tail, got);
+  release(&victim->lock);
+  return head;
+}
+
+// Move a batch of pages to the list of km from the CPU
+// that has the most free pages. Only one kmem lock is held
+// at a time, so concurrent steals cannot deadlock.
+// The unlocked nfree reads may be stale, so if the chosen
+// victim turns out to be empty, try every other CPU in turn
+// under its lock before giving up.
+// Returns the number of pages moved.
+static int
+ksteal(struct kmem *km)
+{
+  struct kmem *k, *victim;
+  struct run *head, *tail;
+  int got;
+
+  victim = 0;
+  for(k = kmem; k < &kmem[ncpu]; k++)
+    if(k != km && (victim == 0 || k->nfree > victim->nfree))
+      victim = k;
+  if(victim == 0)
+    return 0;
+
+  got = 0;
+  head = 0;
+  if(victim->nfree > 0)
+    head = ksteal1(victim, &tail, &got);
+  for(k = kmem; got == 0 && k < &kmem[ncpu]; k++)
+    if(k != km)
+      head = ksteal1(k, &tail, &got);
+  if(got == 0)
+    return 0;
+
+  acquire(&km->lock);
+  kput(km, head, tail, got);
+  release(&km->lock);
+  return got;
+}
+
+// Return the number of free pages.
+int
+kfreecount(void)
+{
+  struct kmem *k;
+  int i, n;
+
+  n = 0;
+  for(k = kmem; k < &kmem[NCPU]; k++)
+    n += k->nfree;
+  for(i = 0; i < NORDER; i++)
+    n += buddy.nfree[i] << i;
+  return n;
+}
+
+// Reserve n pages for a process to allocate later, if the
+// free pages not already reserved cover them.
+// Returns 0 on success, -1 if there is not enough memory.
+int
+kreserve(int n)
+{
+  int ok;
+
+  acquire(&kresv.lock);
+  ok = kresv.n + n <= kfreecount();
+  if(ok)
+    kresv.n += n;
+  release(&kresv.lock);
+  return ok ? 0 : -1;
+}
+
+// Give back n reserved pages, allocated or no longer needed.
+void
+kunreserve(int n)
+{
+  acquire(&kresv.lock);
+  kresv.n -= n;
+  if(kresv.n < 0)
+    panic("kunreserve");
+  release(&kresv.lock);
+}
+
+// Add a reference to the page at v.
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP ||
+     PAGE(v)->ref == 0)
+    panic("kdup");
+  __sync_fetch_and_add(&PAGE(v)->ref, 1);
+}
+
+// Return the number of references to the page at v.
+int
+krefcount(char *v)
+{
+  return PAGE(v)->ref;
+}
+
+// Record what the block at v, just allocated, is used for.
+void
+kown(char *v, int owner)
+{
+  int i;
+
+  for(i = 0; i < 1 << PAGE(v)->order; i++)
+    PAGE(v + i*PGSIZE)->owner = owner;
+}
+
+// Count the pages of physical memory by use, and the free
+// blocks of each order.
+void
+kmemstat(struct kstat *st)
+{
+  struct page *pg;
+  struct kmem *k;
+  uint pa;
+  int i;
+
+  acquire(&buddy.lock);
+  for(i = 0; i < NORDER; i++)
+    st->buddyfree[i] = buddy.nfree[i];
+  release(&buddy.lock);
+  st->kcached = 0;
+  for(k = kmem; k < &kmem[NCPU]; k++)
+    st->kcached += k->nfree;
+
+  memset(st->pages, 0, sizeof(st->pages));
+  st->pgshared = 0;
+  for(pa = PGROUNDUP(V2P(end)); pa < PHYSTOP; pa += PGSIZE){
+    pg = &pages[pa/PGSIZE];
+    if(pg->owner < NPGOWNER)
+      st->pages[pg->owner]++;
+    if(pg->ref > 1)
+      st->pgshared++;
+  }
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(char *v)
 {
   struct run *r;
+  struct kmem *km;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP ||
+     PAGE(v)->ref == 0 || (PAGE(v)->flags & PF_FREE) || PAGE(v)->order)
     panic("kfree");
+  if(__sync_sub_and_fetch(&PAGE(v)->ref, 1) > 0)
+    return;
 
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+  PAGE(v)->flags = PF_FREE;
+  PAGE(v)->owner = PG_FREE;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
+  km = mykmem();
+  if(kmem_use_lock)
+    acquire(&km->lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  kput(km, r, r, 1);
+  if(kmem_use_lock)
+    release(&km->lock);
+  if(km->nfree > KCACHE)
+    kgive(km, KCACHE/2);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +507,91 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  km = mykmem();
+  for(;;){
+    if(kmem_use_lock)
+      acquire(&km->lock);
+    r = km->freelist;
+    if(r){
+      km->freelist = r->next;
+      km->nfree--;
+    }
+    if(kmem_use_lock)
+      release(&km->lock);
+    if(r || (krefill(km) == 0 && (!kmem_use_lock || ksteal(km) == 0)))
+      break;
+  }
+  if(r){
+    if(!(PAGE(r)->flags & PF_FREE))
+      panic("kalloc");
+    PAGE(r)->ref = 1;
+    PAGE(r)->flags = 0;
+    PAGE(r)->owner = PG_KERNEL;
+    PAGE(r)->order = 0;
+  }
   return (char*)r;
 }
 
+// Allocate 2^order physically contiguous pages, aligned to
+// their size.  Returns 0 if there is no free block that big,
+// even after merging the pages cached on the CPU lists.
+char*
+kallocpages(int order)
+{
+  char *v;
+  int i;
+
+  if(order < 0 || order >= NORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+  acquire(&buddy.lock);
+  v = buddyalloc(order);
+  release(&buddy.lock);
+  if(v == 0){
+    kdrain();
+    acquire(&buddy.lock);
+    v = buddyalloc(order);
+    release(&buddy.lock);
+    if(v == 0)
+      return 0;
+  }
+  for(i = 0; i < 1 << order; i++){
+    PAGE(v + i*PGSIZE)->ref = 0;
+    PAGE(v + i*PGSIZE)->flags = 0;
+    PAGE(v + i*PGSIZE)->owner = PG_KERNEL;
+  }
+  PAGE(v)->ref = 1;
+  PAGE(v)->order = order;
+  return v;
+}
+
+// Free the block of 2^order pages at v, which was returned
+// by kallocpages(order).
+void
+kfreepages(char *v, int order)
+{
+  int i;
+
+  if(order == 0){
+    kfree(v);
+    return;
+  }
+  if(order < 0 || order >= NORDER || V2P(v) % (PGSIZE << order) ||
+     v < end || V2P(v) >= PHYSTOP || PAGE(v)->ref != 1 ||
+     PAGE(v)->order != order || (PAGE(v)->flags & PF_FREE))
+    panic("kfreepages");
+
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+  for(i = 0; i < 1 << order; i++){
+    PAGE(v + i*PGSIZE)->ref = 0;
+    PAGE(v + i*PGSIZE)->flags = PF_FREE;
+    PAGE(v + i*PGSIZE)->owner = PG_FREE;
+  }
+  acquire(&buddy.lock);
+  buddyfree(v, order);
+  release(&buddy.lock);
+}
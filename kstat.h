@@ -0,0 +1,44 @@
+#define NIOHIST 16   // buckets in the disk latency histograms
+
+// Uses of physical pages, counted in kstat.pages.
+#define PG_FREE    0  // on a free list
+#define PG_KERNEL  1  // kernel data not listed below
+#define PG_USER    2  // user memory
+#define PG_PGTBL   3  // page directories and page tables
+#define PG_KSTACK  4  // kernel stacks
+#define PG_PIPE    5  // pipe buffers
+#define PG_BUF     6  // disk block cache
+#define PG_PCACHE  7  // page cache of mapped files and programs
+#define NPGOWNER   8
+
+#define NORDER    11  // buddy allocator block orders, 2^0..2^10 pages
+
+// System-wide statistics, filled in by the kstat() system call.
+struct kstat {
+  uint nbuf;         // blocks held by the disk block cache
+  uint bhits;        // block lookups found in the cache
+  uint bmisses;      // block lookups that had to recycle a buffer
+  uint bahead;       // blocks queued by read-ahead
+  uint idecmds;      // disk commands issued
+  uint ideblocks;    // blocks moved by those commands
+  uint iosched;      // disk scheduler: 0 noop, 1 C-LOOK, 2 deadline
+  uint ideseek;      // total distance between commands, in blocks
+  // Request latency, from queueing to completion.  Bucket i
+  // counts requests that took less than 2^(i+1) * 1024 cycles;
+  // the last bucket also counts all slower ones.
+  uint ioread[NIOHIST];
+  uint iowrite[NIOHIST];
+  uint logcommits;    // log commits written
+  uint logops;       // FS operations carried by those commits
+  uint logmaxops;    // most operations carried by a single commit
+  uint loginstalls;  // committed blocks written to their home locations
+  uint logcheckpoints; // times the log was installed in full to make room
+  uint freeblocks;   // free blocks in the root file system
+  uint freeinodes;   // free inodes in the root file system
+  uint dchits;       // directory lookups answered by the name cache
+  uint dcmisses;     // directory lookups that scanned the directory
+  uint pages[NPGOWNER]; // physical pages by use, PG_*
+  uint pgshared;     // pages with more than one reference
+  uint buddyfree[NORDER]; // free blocks of 2^i pages in the buddy allocator
+  uint kcached;      // free pages cached on the per-CPU lists
+};
@@ -5,6 +5,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -16,68 +17,139 @@
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
+// the count of in-progress FS system calls, reserves
+// MAXOPBLOCKS blocks of log space and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// Large writes use begin_opn()/end_opn() to reserve up to
+// log_maxop() blocks at once.
+//
+// Commits are grouped: when the last outstanding end_op()
+// finds the log neither near full nor older than LOGDELAY
+// ticks, it leaves the transaction open so that the next
+// system calls can join it. The logd kernel thread commits
+// a transaction that has gone idle for LOGDELAY ticks, so
+// an operation reaches the disk at most that long after it
+// ends.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk log format, with its size chosen by mkfs:
+//   header blocks, containing the count of logged blocks
+//     followed by block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of one append
+// (and of one install) are queued on the disk together with
+// bwritestart() and then waited for, so the disk can work
+// through them back to back.
+//
+// Installation is lazy. A commit only appends the transaction
+// to the committed ones already in the log; their blocks stay
+// pinned in the buffer cache, and logd writes them to their
+// home locations in the background, oldest first. Once all
+// committed blocks are home, logd empties the log on disk
+// and the open transaction moves to its front. A commit
+// that leaves the log more than half full, or that a waiting
+// system call needs room from, checkpoints: it installs
+// every committed block and empties the log.
+//
+// In memory, log.lh.block[] holds:
+//   [0, installed)           committed and home
+//   [installed, ncommitted)  committed, waiting for logd
+//   [ncommitted, lh.n)       the open transaction
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+#define LOGENT (BSIZE / sizeof(uint))  // header words per block
+#define LOGBATCH 32  // blocks queued on the disk at once
+
+// Contents of the header blocks, used to keep track in memory
+// of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOGSIZE];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int nhead;       // header blocks at start
+  int size;        // usable data blocks after the header
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by executing sys calls.
+  int waiting;     // a sys call is waiting for log space.
   int committing;  // in commit(), please wait.
   int dev;
+  uint grpstart;   // ticks when the open transaction logged its first block
+  int grpops;      // FS sys calls in the open transaction
+  int ncommitted;  // committed entries at the front of lh.block[]
+  int installed;   // of those, entries already at their home locations
+  int installing;  // logd is writing a block home, commit must wait.
   struct logheader lh;
+
+  // statistics
+  uint ncommit;
+  uint nops;
+  uint maxops;
+  uint ninstall;
+  uint ncheckpoint;
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logd(void);
+static int install(void);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   struct superblock sb;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  log.nhead = sb.nloghead;
+  log.size = sb.nlog - sb.nloghead;
   log.dev = dev;
+  if (log.size < LOGSIZE || LOGHDRSIZE(log.size) > log.nhead)
+    panic("initlog: bad log size");
   recover_from_log();
+
+  // Use no more of the log than the kernel can track and
+  // the buffer cache can pin while committing.
+  if (log.size > MAXLOGSIZE)
+    log.size = MAXLOGSIZE;
+  if (log.size > bcount() / 2)
+    log.size = bcount() / 2;
+  if (log.size < LOGSIZE)
+    panic("initlog: buffer cache too small");
+  kthread("logd", logd);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// Used only by recovery; logd and checkpoint() install from
+// the cache.
 static void
 install_trans(void)
 {
-  int tail;
+  int tail, i, n;
+  struct buf *dbuf[LOGBATCH];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+log.nhead+tail+i); // read log block
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      bwritestart(dbuf[i]);  // start writing dst to disk
+      brelse(lbuf);
+    }
+    for (i = 0; i < n; i++) {
+      bwait(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -86,30 +158,43 @@ static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
+  uint *w = (uint*) (buf->data);
+  int i, k;
+
+  log.lh.n = w[0];
+  if (log.lh.n < 0 || log.lh.n > MAXLOGSIZE || LOGHDRSIZE(log.lh.n) > log.nhead)
+    panic("read_head: bad log header");
   for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+    k = i + 1;
+    if (k % LOGENT == 0) {
+      brelse(buf);
+      buf = bread(log.dev, log.start + k/LOGENT);
+      w = (uint*) (buf->data);
+    }
+    log.lh.block[i] = w[k % LOGENT];
   }
   brelse(buf);
 }
 
 // Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Writing the first header block, which holds the count,
+// is the true point at which the current transaction
+// commits, so it goes out after the others.
 static void
 write_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf *buf;
+  uint *w;
+  int j, k;
+
+  for (j = LOGHDRSIZE(log.lh.n) - 1; j >= 0; j--) {
+    buf = bread(log.dev, log.start + j);
+    w = (uint*) (buf->data);
+    for (k = j*LOGENT; k < (j+1)*LOGENT && k <= log.lh.n; k++)
+      w[k % LOGENT] = k == 0 ? log.lh.n : log.lh.block[k-1];
+    bwrite(buf);
+    brelse(buf);
   }
-  bwrite(buf);
-  brelse(buf);
 }
 
 static void
@@ -121,39 +206,91 @@ recover_from_log(void)
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that
+// writes at most n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.size){
       // this op might exhaust log space; wait for commit.
+      log.waiting = 1;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// The most blocks a single FS system call may reserve,
+// leaving room for others to run alongside it.
+int
+log_maxop(void)
 {
-  int do_commit = 0;
+  if(log.size / 4 < MAXOPBLOCKS)
+    return MAXOPBLOCKS;
+  return log.size / 4;
+}
 
+// Should the open transaction be committed now rather than
+// left for later system calls to join?
+// Caller holds log.lock.
+static int
+commitdue(void)
+{
+  if(log.lh.n == log.ncommitted)
+    return 0;
+  return log.waiting || log.lh.n + MAXOPBLOCKS > log.size ||
+         ticks - log.grpstart >= LOGDELAY;
+}
+
+// Commit the open transaction. Called with log.lock held and
+// no outstanding operations; returns with log.lock held.
+static void
+groupcommit(void)
+{
+  log.committing = 1;
+  while(log.installing)
+    sleep(&log.installing, &log.lock);
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.waiting = 0;
+  wakeup(&log);
+}
+
+// called at the end of each FS system call that began
+// with begin_opn(n).
+// commits if this was the last outstanding operation
+// and the transaction is full or old enough.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= n;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.lh.n > log.ncommitted)
+    log.grpops++;
+  if(log.outstanding == 0 && commitdue()){
+    groupcommit();
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -161,49 +298,183 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Kernel thread that commits transactions left open by
+// end_op() once they have waited LOGDELAY ticks, and
+// installs committed blocks at their home locations.
+static void
+logd(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(log.outstanding == 0 && !log.committing && commitdue())
+      groupcommit();
+    else if(install() == 0)
+      sleep(&ticks, &log.lock);
+  }
+}
+
+// Is block b logged in lh.block[from, to)?
+// Caller holds log.lock or is committing.
+static int
+logged(int b, int from, int to)
+{
+  int i;
+
+  for(i = from; i < to; i++)
+    if(log.lh.block[i] == b)
+      return 1;
+  return 0;
+}
+
+// Install committed blocks, oldest first, by writing their
+// cached copies home. A block the open transaction has
+// changed again no longer holds its committed contents, so
+// installation stops there until the next commit.
+// Called by logd with log.lock held; returns the number of
+// entries installed.
+static int
+install(void)
+{
+  struct buf *b;
+  int i, n, blockno;
+
+  n = 0;
+  while(!log.committing && log.installed < log.ncommitted){
+    i = log.installed;
+    blockno = log.lh.block[i];
+    if(logged(blockno, i+1, log.ncommitted)){
+      // a later committed entry will install it.
+      log.installed++;
+      n++;
+      continue;
+    }
+    log.installing = 1;
+    release(&log.lock);
+    b = bread(log.dev, blockno);
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    // holding b's lock keeps FS calls from changing and
+    // logging it again until it is home.
+    if(!logged(blockno, log.ncommitted, log.lh.n)){
+      release(&log.lock);
+      bwrite(b);
+      acquire(&log.lock);
+      log.installed++;
+      log.ninstall++;
+      n++;
+    }
+    log.installing = 0;
+    wakeup(&log.installing);
+    release(&log.lock);
+    brelse(b);
+    acquire(&log.lock);
+    if(log.installed == i)
+      break;
+  }
+
+  if(!log.committing && log.ncommitted > 0 && log.installed == log.ncommitted){
+    // Everything committed is home: empty the log on disk
+    // and start it over with the open transaction.
+    log.installing = 1;
     release(&log.lock);
+    b = bread(log.dev, log.start);
+    ((uint*)b->data)[0] = 0;
+    bwrite(b);
+    brelse(b);
+    acquire(&log.lock);
+    memmove(log.lh.block, log.lh.block + log.ncommitted,
+            (log.lh.n - log.ncommitted) * sizeof(int));
+    log.lh.n -= log.ncommitted;
+    log.ncommitted = log.installed = 0;
+    log.installing = 0;
+    wakeup(&log.installing);
+    n++;
   }
+  return n;
 }
 
-// Copy modified blocks from cache to log.
+// Install every committed block and empty the log.
+// Called by commit(), so no FS calls are running.
+static void
+checkpoint(void)
+{
+  int i, n;
+  struct buf *dbuf[LOGBATCH];
+
+  n = 0;
+  for (i = log.installed; i < log.lh.n; i++) {
+    if (logged(log.lh.block[i], i+1, log.lh.n))
+      continue;  // a later entry installs it
+    dbuf[n] = bread(log.dev, log.lh.block[i]);
+    bwritestart(dbuf[n++]);  // start writing it home
+    log.ninstall++;
+    if (n == LOGBATCH || i == log.lh.n - 1) {
+      while (n > 0) {
+        n--;
+        bwait(dbuf[n]);
+        brelse(dbuf[n]);
+      }
+    }
+  }
+  log.lh.n = log.ncommitted = log.installed = 0;
+  write_head();    // Erase the committed transactions from the log
+  log.ncheckpoint++;
+}
+
+// Copy the open transaction's modified blocks from cache to log.
 static void
 write_log(void)
 {
-  int tail;
+  int tail, i, n;
+  struct buf *to[LOGBATCH];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = log.ncommitted; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+log.nhead+tail+i); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      bwritestart(to[i]);  // start writing the log
+      brelse(from);
+    }
+    for (i = 0; i < n; i++) {
+      bwait(to[i]);
+      brelse(to[i]);
+    }
   }
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
+  if (log.lh.n > log.ncommitted) {
+    log.ncommit++;
+    log.nops += log.grpops;
+    if(log.grpops > log.maxops)
+      log.maxops = log.grpops;
+    log.grpops = 0;
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.ncommitted = log.lh.n;
+    if (log.waiting || log.lh.n > log.size / 2)
+      checkpoint();  // Install now to make room
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// commit()/write_log() will do the log write, and logd or
+// checkpoint() the write to the block's home location.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -215,20 +486,34 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
+  for (i = log.ncommitted; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
   log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n){
+    if (log.lh.n == log.ncommitted)
+      log.grpstart = ticks;
     log.lh.n++;
+  }
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
 
+void
+logstat(struct kstat *st)
+{
+  acquire(&log.lock);
+  st->logcommits = log.ncommit;
+  st->logops = log.nops;
+  st->logmaxops = log.maxops;
+  st->loginstalls = log.ninstall;
+  st->logcheckpoints = log.ncheckpoint;
+  release(&log.lock);
+}
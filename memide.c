@@ -12,6 +12,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
@@ -58,3 +59,31 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+// The memory disk is synchronous: do the transfer
+// and run the completion callback right away.
+void
+idesubmit(struct buf *b)
+{
+  void (*done)(struct buf*);
+
+  iderw(b);
+  if((done = b->iodone) != 0){
+    b->iodone = 0;
+    done(b);
+  }
+}
+
+void
+iowait(struct buf *b)
+{
+}
+
+void
+idestat(struct kstat *st)
+{
+  st->idecmds = st->ideblocks = st->ideseek = 0;
+  st->iosched = 0;
+  memset(st->ioread, 0, sizeof(st->ioread));
+  memset(st->iowrite, 0, sizeof(st->iowrite));
+}
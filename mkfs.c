@@ -15,14 +15,15 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 4096
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nloghead; // Number of log header blocks
+int nlog;     // Number of log blocks, header included
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +41,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void hashdir(uint inum, uint parent, struct dirent *ents, int n);
 
 // convert to intel byte order
 ushort
@@ -67,9 +69,10 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, nent;
   uint rootino, inum, off;
   struct dirent de;
+  static struct dirent ents[NINODES];
   char buf[BSIZE];
   struct dinode din;
 
@@ -90,6 +93,15 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  // Give the log about 1/16 of the disk.
+  nlog = FSSIZE / 16;
+  if(nlog < LOGSIZE)
+    nlog = LOGSIZE;
+  if(nlog > MAXLOGSIZE)
+    nlog = MAXLOGSIZE;
+  nloghead = LOGHDRSIZE(nlog);
+  nlog += nloghead;
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -98,12 +110,14 @@ main(int argc, char *argv[])
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
+  sb.nloghead = xint(nloghead);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.bsize = xint(BSIZE);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d of %d bytes\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE, BSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -116,16 +130,19 @@ main(int argc, char *argv[])
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
+  nent = 0;
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  if(!HASHDIR){
+    bzero(&de, sizeof(de));
+    de.inum = xshort(rootino);
+    strcpy(de.name, ".");
+    iappend(rootino, &de, sizeof(de));
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+    bzero(&de, sizeof(de));
+    de.inum = xshort(rootino);
+    strcpy(de.name, "..");
+    iappend(rootino, &de, sizeof(de));
+  }
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -147,7 +164,10 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    if(HASHDIR)
+      ents[nent++] = de;
+    else
+      iappend(rootino, &de, sizeof(de));
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -155,12 +175,19 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(HASHDIR){
+    hashdir(rootino, rootino, ents, nent);
+    rinode(rootino, &din);
+    din.major = xshort(DIRHASH);
+    winode(rootino, &din);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
@@ -252,6 +279,63 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block holding block fbn of the file din,
+// allocating it when fbn is just past the end of the file.
+// Consecutive allocations from freeblock extend the file's
+// last extent.
+uint
+fmap(struct dinode *din, uint fbn)
+{
+  struct extent x[NEXTENT+NINDIRECT];
+  uint lbn, b;
+  int i, n;
+
+  memset(x, 0, sizeof(x));
+  for(i = 0; i < NEXTENT; i++){
+    x[i].start = xint(din->ext[i].start);
+    x[i].len = xint(din->ext[i].len);
+  }
+  if(xint(din->indirect[0])){
+    rsect(xint(din->indirect[0]), (char*)&x[NEXTENT]);
+    for(i = NEXTENT; i < NEXTENT+NINDIRECT; i++){
+      x[i].start = xint(x[i].start);
+      x[i].len = xint(x[i].len);
+    }
+  }
+
+  lbn = 0;
+  for(n = 0; n < NEXTENT+NINDIRECT && x[n].len > 0; n++){
+    if(fbn < lbn + x[n].len)
+      return x[n].start + (fbn - lbn);
+    lbn += x[n].len;
+  }
+
+  assert(fbn == lbn);
+  b = freeblock++;
+  if(n > 0 && x[n-1].start + x[n-1].len == b){
+    x[n-1].len++;
+    n--;
+  } else {
+    assert(n < NEXTENT+NINDIRECT);
+    x[n].start = b;
+    x[n].len = 1;
+  }
+
+  if(n < NEXTENT){
+    din->ext[n].start = xint(x[n].start);
+    din->ext[n].len = xint(x[n].len);
+  } else {
+    if(xint(din->indirect[0]) == 0)
+      din->indirect[0] = xint(freeblock++);
+    for(i = NEXTENT; i < NEXTENT+NINDIRECT; i++){
+      x[i].start = xint(x[i].start);
+      x[i].len = xint(x[i].len);
+    }
+    wsect(xint(din->indirect[0]), (char*)&x[NEXTENT]);
+  }
+  return b;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +343,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,23 +350,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,3 +362,50 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Write the n entries of empty directory inum as a hashed
+// directory, with a table deep enough that no page overflows.
+void
+hashdir(uint inum, uint parent, struct dirent *ents, int n)
+{
+  static int cnt[1 << DMAXDEPTH];
+  char buf[BSIZE];
+  struct dirent *de;
+  struct dirhead *hd;
+  uint depth, npage, pg;
+  int i, j;
+
+  for(depth = 0; ; depth++){
+    assert(depth <= DMAXDEPTH);
+    npage = 1 << depth;
+    memset(cnt, 0, sizeof(cnt));
+    for(i = 0; i < n; i++)
+      if(++cnt[dirhash(ents[i].name) & (npage-1)] > DPE)
+        break;
+    if(i == n)
+      break;
+  }
+
+  bzero(buf, sizeof(buf));
+  de = (struct dirent*)buf;
+  de[0].inum = xshort(inum);
+  strcpy(de[0].name, ".");
+  de[1].inum = xshort(parent);
+  strcpy(de[1].name, "..");
+  hd = (struct dirhead*)buf + 2;
+  hd->depth = xshort(depth);
+  hd->count = xint(n);
+  for(pg = 0; pg < npage; pg++)
+    ((struct dirtab*)buf + 3 + pg/DTPS)->page[pg%DTPS] = xshort(1 + pg);
+  iappend(inum, buf, sizeof(buf));
+
+  for(pg = 0; pg < npage; pg++){
+    bzero(buf, sizeof(buf));
+    de = (struct dirent*)buf;
+    for(i = j = 0; i < n; i++)
+      if((dirhash(ents[i].name) & (npage-1)) == pg)
+        de[j++] = ents[i];
+    ((struct dirpage*)buf + DPE)->depth = xshort(depth);
+    iappend(inum, buf, sizeof(buf));
+  }
+}
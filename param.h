@@ -2,13 +2,37 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NMMAP         8  // mapped files per process
+#define NSEG          4  // program segments per process
+#ifndef PIPEORDER
+#define PIPEORDER     2  // a pipe buffer takes 2^PIPEORDER contiguous pages
+#endif
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#ifndef NINODE
+#define NINODE     1000  // maximum number of active i-nodes
+#endif
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*3)  // min data blocks in on-disk log
+#define MAXLOGSIZE   1024  // max data blocks of the log the kernel uses
+#ifndef LOGDELAY
+#define LOGDELAY     5  // ticks a log commit may wait for more FS ops
+#endif
+#ifndef NBUF
+#define NBUF         0  // size of disk block cache; 0 sizes it from memory
+#endif
+#define MINNBUF      (LOGSIZE*3)  // smallest disk block cache
+#define MAXNBUF      8192  // largest disk block cache
+#define FSSIZE       (10000*1024/BSIZE)  // size of file system in blocks
+#ifndef IOSCHED
+#define IOSCHED      1  // disk scheduler: 0 noop, 1 C-LOOK, 2 deadline
+#endif
+#ifndef RAMAX
+#define RAMAX        32  // max blocks of read-ahead per file; 0 disables
+#endif
 
+#ifndef HASHDIR
+#define HASHDIR      0  // 1: mkdir and mkfs make hashed directories
+#endif
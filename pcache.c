@@ -0,0 +1,282 @@
+// Page cache.
+//
+// The page cache holds whole pages of file content for mapped
+// files, keyed by (dev, inum, offset within the file).
+// Every mapping of a page shares the one physical copy, and
+// cp->ref counts the page table entries that point at it.
+// A page that nobody maps stays cached on an LRU list, and
+// pcget() recycles the least recently released one, page and
+// all, when it needs an entry.
+//
+// The cache also holds pages of programs for exec(), which
+// need not start at a page boundary in the file.  pctext()
+// hands out such a page with kdup(), for mapping copy-on-write,
+// and leaves the entry on the LRU list at once; the entry is
+// not recycled while krefcount() shows it is still mapped.
+//
+// writei() keeps cached pages up to date through pcwrite(), so
+// mappings see writes to the file.  writei() refuses to write a
+// program while a process runs it, but its pages stay cached
+// afterwards, so a write forgets them instead.  iput() calls
+// pcpurge() when it frees an inode, before the inum can be
+// reused.
+// A page is read in by the process that first asks for it,
+// without pcache.lock; others asking meanwhile sleep until
+// cp->valid is set.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "kstat.h"
+
+#define NPCACHE 512  // pages
+#define NPHASH  257
+
+struct cpage {
+  uint dev;
+  uint inum;            // 0 if the entry holds no page
+  uint off;
+  int text;             // page of a program, for pctext()
+  char *data;           // page, kept when the entry is recycled
+  int ref;              // page table entries mapping data
+  int valid;            // data has been read from the file
+  struct cpage *hnext;  // hash chain
+  struct cpage *lprev;  // LRU list of entries with ref == 0
+  struct cpage *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage page[NPCACHE];
+  struct cpage *hash[NPHASH];
+  // lru.lnext is the least recently released.
+  struct cpage lru;
+} pcache;
+
+#define PHASH(dev, inum, off) \
+  (((dev) * 31 + (inum) * 17 + (off) / PGSIZE) % NPHASH)
+
+// Caller holds pcache.lock.
+static void
+lruremove(struct cpage *cp)
+{
+  cp->lnext->lprev = cp->lprev;
+  cp->lprev->lnext = cp->lnext;
+}
+
+// Caller holds pcache.lock.
+static void
+lruappend(struct cpage *cp)
+{
+  cp->lnext = &pcache.lru;
+  cp->lprev = pcache.lru.lprev;
+  pcache.lru.lprev->lnext = cp;
+  pcache.lru.lprev = cp;
+}
+
+// Caller holds pcache.lock.
+static struct cpage*
+pcfind(uint dev, uint inum, uint off, int text)
+{
+  struct cpage *cp;
+
+  for(cp = pcache.hash[PHASH(dev, inum, off)]; cp; cp = cp->hnext)
+    if(cp->inum == inum && cp->off == off && cp->dev == dev &&
+       cp->text == text)
+      return cp;
+  return 0;
+}
+
+// Remove cp from its hash chain.
+// Caller holds pcache.lock.
+static void
+pcunhash(struct cpage *cp)
+{
+  struct cpage **pp;
+
+  for(pp = &pcache.hash[PHASH(cp->dev, cp->inum, cp->off)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == cp){
+      *pp = cp->hnext;
+      break;
+    }
+  }
+  cp->inum = 0;
+}
+
+void
+pcinit(void)
+{
+  int i;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.lprev = pcache.lru.lnext = &pcache.lru;
+  for(i = 0; i < NPCACHE; i++)
+    lruappend(&pcache.page[i]);
+}
+
+// Return the entry for the page of ip's content at off,
+// reading it if it is not cached, with one more reference.
+// ip need not be locked.  Returns 0 if there is no free entry
+// or memory.
+static struct cpage*
+pclookup(struct inode *ip, uint off, int text)
+{
+  struct cpage *cp;
+  int locked;
+
+  acquire(&pcache.lock);
+  if((cp = pcfind(ip->dev, ip->inum, off, text)) != 0){
+    if(cp->ref++ == 0)
+      lruremove(cp);
+    while(!cp->valid)
+      sleep(cp, &pcache.lock);
+    release(&pcache.lock);
+    return cp;
+  }
+
+  // Recycle the least recently released entry whose page
+  // no process maps any more.
+  for(cp = pcache.lru.lnext; cp != &pcache.lru; cp = cp->lnext)
+    if(cp->data == 0 || krefcount(cp->data) == 1)
+      break;
+  if(cp == &pcache.lru || (cp->data == 0 && (cp->data = kalloc()) == 0)){
+    release(&pcache.lock);
+    return 0;
+  }
+  kown(cp->data, PG_PCACHE);
+  lruremove(cp);
+  if(cp->inum)
+    pcunhash(cp);
+  cp->dev = ip->dev;
+  cp->inum = ip->inum;
+  cp->off = off;
+  cp->text = text;
+  cp->ref = 1;
+  cp->valid = 0;
+  cp->hnext = pcache.hash[PHASH(cp->dev, cp->inum, off)];
+  pcache.hash[PHASH(cp->dev, cp->inum, off)] = cp;
+  release(&pcache.lock);
+
+  // The faulting process may hold ip->lock already, in the
+  // middle of a system call.
+  memset(cp->data, 0, PGSIZE);
+  if(!(locked = holdingsleep(&ip->lock)))
+    ilock(ip);
+  readi(ip, cp->data, off, PGSIZE);
+  if(!locked)
+    iunlock(ip);
+
+  acquire(&pcache.lock);
+  cp->valid = 1;
+  wakeup(cp);
+  release(&pcache.lock);
+  return cp;
+}
+
+// Drop a reference to cp.
+// Caller holds pcache.lock.
+static void
+pcrelse(struct cpage *cp)
+{
+  if(cp->ref < 1)
+    panic("pcrelse");
+  if(--cp->ref == 0)
+    lruappend(cp);
+}
+
+// Return page pgno of ip's content, reading it if it is not
+// cached, and count one more mapping of it.  ip need not be
+// locked.  Returns 0 if there is no free entry or memory.
+char*
+pcget(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+
+  if((cp = pclookup(ip, pgno*PGSIZE, 0)) == 0)
+    return 0;
+  return cp->data;
+}
+
+// Drop one mapping of page pgno of ip.
+void
+pcput(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  if((cp = pcfind(ip->dev, ip->inum, pgno*PGSIZE, 0)) == 0)
+    panic("pcput");
+  pcrelse(cp);
+  release(&pcache.lock);
+}
+
+// Return the page of program ip whose content starts at off,
+// with a reference from kdup() that the caller maps
+// copy-on-write and drops with kfree().
+char*
+pctext(struct inode *ip, uint off)
+{
+  struct cpage *cp;
+
+  if((cp = pclookup(ip, off, 1)) == 0)
+    return 0;
+  acquire(&pcache.lock);
+  kdup(cp->data);
+  pcrelse(cp);
+  release(&pcache.lock);
+  return cp->data;
+}
+
+// Copy n bytes at src, just written to ip at offset off,
+// into the cached pages they fall in.  Caller holds ip->lock.
+void
+pcwrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct cpage *cp, *next;
+  uint pg, lo, hi;
+
+  if(n == 0)
+    return;
+  acquire(&pcache.lock);
+  // A program page overlapping the write may start in the
+  // page before it.
+  pg = off/PGSIZE > 0 ? off/PGSIZE - 1 : 0;
+  for(; pg <= (off + n - 1)/PGSIZE; pg++){
+    for(cp = pcache.hash[PHASH(ip->dev, ip->inum, pg*PGSIZE)]; cp; cp = next){
+      next = cp->hnext;
+      if(cp->inum != ip->inum || cp->dev != ip->dev || cp->off/PGSIZE != pg)
+        continue;
+      lo = cp->off > off ? cp->off : off;
+      hi = cp->off + PGSIZE < off + n ? cp->off + PGSIZE : off + n;
+      if(lo >= hi)
+        continue;
+      if(cp->text)
+        pcunhash(cp);
+      else
+        memmove(cp->data + (lo - cp->off), src + (lo - off), hi - lo);
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Forget the cached pages of ip, which is being freed.
+void
+pcpurge(struct inode *ip)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  for(cp = pcache.page; cp < &pcache.page[NPCACHE]; cp++){
+    if(cp->inum == ip->inum && cp->dev == ip->dev){
+      if(cp->ref != 0)
+        panic("pcpurge");
+      pcunhash(cp);
+    }
+  }
+  release(&pcache.lock);
+}
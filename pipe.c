@@ -7,12 +7,16 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "kstat.h"
 
-#define PIPESIZE 512
+// The buffer is a block of 2^PIPEORDER pages, allocated
+// apart from the pipe itself.  PIPESIZE is a power of two, so
+// that nread and nwrite index the buffer correctly when they wrap.
+#define PIPESIZE (PGSIZE << PIPEORDER)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
@@ -30,6 +34,10 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((p = (struct pipe*)kalloc()) == 0)
     goto bad;
+  kown((char*)p, PG_PIPE);
+  if((p->data = kallocpages(PIPEORDER)) == 0)
+    goto bad;
+  kown(p->data, PG_PIPE);
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
@@ -47,8 +55,11 @@ pipealloc(struct file **f0, struct file **f1)
 
 //PAGEBREAK: 20
  bad:
-  if(p)
+  if(p){
+    if(p->data)
+      kfreepages(p->data, PIPEORDER);
     kfree((char*)p);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -69,6 +80,7 @@ pipeclose(struct pipe *p, int writable)
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
+    kfreepages(p->data, PIPEORDER);
     kfree((char*)p);
   } else
     release(&p->lock);
@@ -6,6 +6,7 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "kstat.h"
 
 struct {
   struct spinlock lock;
@@ -96,6 +97,7 @@ found:
     p->state = UNUSED;
     return 0;
   }
+  kown(p->kstack, PG_KSTACK);
   sp = p->kstack + KSTACKSIZE;
 
   // Leave room for trap frame.
@@ -158,14 +160,24 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, npg;
   struct proc *curproc = myproc();
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Only reserve the space; pagefault() allocates each page
+    // when it is first touched.  Refuse to reserve more than
+    // the free memory no process has reserved yet, so that
+    // malloc() can still fail.
+    npg = (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE;
+    if(sz + n > mmapfloor(curproc) || kreserve(npg) < 0)
       return -1;
+    curproc->lazy += npg;
+    sz += n;
   } else if(n < 0){
+    npg = uvmabsent(curproc->pgdir, sz + n, sz);
+    curproc->lazy -= npg;
+    kunreserve(npg);
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
   }
@@ -189,14 +201,23 @@ fork(void)
     return -1;
   }
 
-  // Copy process state from proc.
+  // Copy process state from proc.  The child inherits the
+  // parent's untouched pages, so it needs its own reservation.
+  if(kreserve(curproc->lazy) < 0){
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+    kunreserve(curproc->lazy);
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
+  np->lazy = curproc->lazy;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -207,6 +228,16 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  if(curproc->exe)
+    np->exe = itextdup(curproc->exe);
+  else
+    np->exe = 0;
+  memmove(np->seg, curproc->seg, sizeof(curproc->seg));
+  for(i = 0; i < NMMAP; i++){
+    np->vma[i] = curproc->vma[i];
+    if(np->vma[i].f)
+      filedup(np->vma[i].f);
+  }
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -221,6 +252,30 @@ fork(void)
   return pid;
 }
 
+// Start a kernel thread running fn, which must never return.
+// The thread has no user memory and no parent; forkret()
+// returns into fn instead of trapret.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kthread: out of memory?");
+  p->sz = 0;
+  p->parent = 0;
+  *(uint*)(p->context + 1) = (uint)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->state = RUNNABLE;
+
+  release(&ptable.lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -234,6 +289,10 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  munmapall(curproc);
+  kunreserve(curproc->lazy);
+  curproc->lazy = 0;
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -244,8 +303,11 @@ exit(void)
 
   begin_op();
   iput(curproc->cwd);
+  if(curproc->exe)
+    itextput(curproc->exe);
   end_op();
   curproc->cwd = 0;
+  curproc->exe = 0;
 
   acquire(&ptable.lock);
 
@@ -405,8 +467,8 @@ forkret(void)
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
-    iinit(ROOTDEV);
     initlog(ROOTDEV);
+    iinit(ROOTDEV);  // after recovery, which may change the bitmap
   }
 
   // Return to "caller", actually trapret (see allocproc).
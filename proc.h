@@ -34,9 +34,26 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A file mapped into a process by mmap().
+struct vma {
+  uint start;                  // first address, page-aligned
+  uint end;                    // address after the last page
+  struct file *f;              // 0 if the slot is unused
+  uint off;                    // file offset mapped at start
+};
+
+// A segment of the program, loaded from p->exe as it is touched.
+struct seg {
+  uint vaddr;                  // first address, page-aligned
+  uint memsz;                  // 0 if the slot is unused
+  uint off;                    // file offset of the content at vaddr
+  uint filesz;                 // bytes from the file; the rest is zero
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
+  uint lazy;                   // Pages below sz not touched yet
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
@@ -48,11 +65,16 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NMMAP];       // Mapped files
+  struct inode *exe;           // Program file, or 0
+  struct seg seg[NSEG];        // Program segments in exe
   char name[16];               // Process name (debugging)
 };
 
 // Process memory is laid out contiguously, low addresses first:
-//   text
-//   original data and bss
+//   text                      (faulted in from p->exe)
+//   original data and bss     (faulted in from p->exe)
 //   fixed-size stack
 //   expandable heap
+//   ...
+//   mapped files, placed downwards from MMAPTOP
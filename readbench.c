@@ -0,0 +1,51 @@
+// Sequential read benchmark.
+// Reads each named file from start to end in 512-byte
+// pieces, as cat does, and reports the time taken and the
+// buffer cache misses it caused.  Run it on files that are
+// not cached yet (e.g. right after boot), once on a kernel
+// built with RAMAX=0 and once with read-ahead enabled.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "kstat.h"
+
+char buf[512];
+
+void
+readfile(char *path)
+{
+  struct kstat st0, st1;
+  int fd, n, tot, start, t;
+
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf(2, "readbench: cannot open %s\n", path);
+    return;
+  }
+  kstat(&st0);
+  start = uptime();
+  tot = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    tot += n;
+  t = uptime() - start;
+  kstat(&st1);
+  close(fd);
+
+  printf(1, "%s: %d bytes in %d ticks, %d misses, %d read ahead\n",
+         path, tot, t, st1.bmisses - st0.bmisses, st1.bahead - st0.bahead);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i;
+
+  if(argc < 2){
+    printf(2, "usage: readbench files...\n");
+    exit();
+  }
+  for(i = 1; i < argc; i++)
+    readfile(argv[i]);
+  exit();
+}
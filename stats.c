@@ -0,0 +1,66 @@
+// Print kernel statistics.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+char *scheds[] = { "noop", "c-look", "deadline" };
+char *owners[NPGOWNER] = {
+[PG_FREE]    "free",
+[PG_KERNEL]  "kernel",
+[PG_USER]    "user",
+[PG_PGTBL]   "page tables",
+[PG_KSTACK]  "kernel stacks",
+[PG_PIPE]    "pipes",
+[PG_BUF]     "bcache",
+[PG_PCACHE]  "page cache",
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct kstat st;
+  int i, free, small;
+
+  if(kstat(&st) < 0){
+    printf(2, "stats: kstat failed\n");
+    exit();
+  }
+  printf(1, "bcache: %d blocks, %d hits, %d misses, %d read ahead\n",
+         st.nbuf, st.bhits, st.bmisses, st.bahead);
+  printf(1, "disk: %d commands, %d blocks, seek distance %d, scheduler %s\n",
+         st.idecmds, st.ideblocks, st.ideseek, scheds[st.iosched % 3]);
+  printf(1, "log: %d commits, %d ops, %d ops/commit avg, %d max\n",
+         st.logcommits, st.logops,
+         st.logcommits ? st.logops / st.logcommits : 0, st.logmaxops);
+  printf(1, "log: %d blocks installed, %d checkpoints\n",
+         st.loginstalls, st.logcheckpoints);
+  printf(1, "fs: %d free blocks, %d free inodes\n",
+         st.freeblocks, st.freeinodes);
+  printf(1, "dcache: %d hits, %d misses\n", st.dchits, st.dcmisses);
+  printf(1, "pages:");
+  for(i = 0; i < NPGOWNER; i++)
+    printf(1, "%s %d %s", i ? "," : "", st.pages[i], owners[i]);
+  printf(1, "; %d shared\n", st.pgshared);
+  // A free page is unusable for an order-i request if it is
+  // in a smaller free block.
+  free = 0;
+  for(i = 0; i < NORDER; i++)
+    free += st.buddyfree[i] << i;
+  printf(1, "buddy: %d free pages, %d more cached on cpus\n", free, st.kcached);
+  small = 0;
+  for(i = 0; i < NORDER; i++){
+    printf(1, "  order %d: %d free blocks, %d%% of free pages unusable\n",
+           i, st.buddyfree[i], free ? small * 100 / free : 0);
+    small += st.buddyfree[i] << i;
+  }
+  printf(1, "disk latency (kcycles): reads / writes\n");
+  for(i = 0; i < NIOHIST; i++){
+    if(st.ioread[i] == 0 && st.iowrite[i] == 0)
+      continue;
+    printf(1, "  %s%d: %d / %d\n", i == NIOHIST-1 ? ">=" : "<",
+           i == NIOHIST-1 ? 1<<i : 2<<i, st.ioread[i], st.iowrite[i]);
+  }
+  exit();
+}
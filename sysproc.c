@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "kstat.h"
 
 int
 sys_fork(void)
@@ -89,3 +90,19 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// Fill in system-wide statistics.
+int
+sys_kstat(void)
+{
+  struct kstat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  bstat(st);
+  idestat(st);
+  logstat(st);
+  fsstat(st);
+  kmemstat(st);
+  return 0;
+}
@@ -78,6 +78,18 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    if(myproc() && pagefault(rcr2(), tf->err) == 0)
+      break;
+    if((tf->cs&3) == 0){
+      // System calls fault in the user memory they use before
+      // taking any locks, so this is a kernel bug.
+      cprintf("kernel page fault on cpu %d eip %x addr 0x%x err %d\n",
+              cpuid(), tf->eip, rcr2(), tf->err);
+      panic("pagefault");
+    }
+    // Not a page that can be mapped in: fall through.
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
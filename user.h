@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct kstat;
 
 // system calls
 int fork(void);
@@ -23,6 +24,9 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int kstat(struct kstat*);
+char* mmap(int, int, int);
+int munmap(char*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
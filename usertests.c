@@ -184,6 +184,8 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+#define BIGBLOCKS 300  // blocks in writetest1's big file
+
 void
 writetest1(void)
 {
@@ -197,7 +199,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +219,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == BIGBLOCKS - 1){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -300,6 +302,34 @@ exectest(void)
   }
 }
 
+// a running program cannot be opened for writing,
+// even after a forked copy of it exits
+void
+textbusytest(void)
+{
+  int fd, pid;
+
+  printf(stdout, "textbusy test\n");
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0)
+    exit();
+  wait();
+  if((fd = open("usertests", O_WRONLY)) >= 0){
+    printf(stdout, "opened running usertests for writing\n");
+    exit();
+  }
+  if((fd = open("usertests", O_RDONLY)) < 0){
+    printf(stdout, "open usertests failed\n");
+    exit();
+  }
+  close(fd);
+  printf(stdout, "textbusy ok\n");
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1200,6 +1230,122 @@ bigfile(void)
   printf(1, "bigfile test ok\n");
 }
 
+// write and read back files of several sizes, printing
+// how long each takes.
+void
+largefiles(void)
+{
+  static int sizes[] = { 64, 256, 1024, 4096 };  // KB
+  int fd, i, j, n, nblock, t0, t1, t2;
+
+  printf(1, "large files test\n");
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    nblock = sizes[i] * 1024 / 512;
+    unlink("largefile");
+    fd = open("largefile", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf(1, "cannot create largefile\n");
+      exit();
+    }
+    t0 = uptime();
+    for(n = 0; n < nblock; n += sizeof(buf)/512){
+      for(j = 0; j < sizeof(buf)/512; j++)
+        ((int*)buf)[j*512/sizeof(int)] = n + j;
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf(1, "write largefile failed at block %d\n", n);
+        exit();
+      }
+    }
+    close(fd);
+
+    t1 = uptime();
+    fd = open("largefile", 0);
+    if(fd < 0){
+      printf(1, "cannot open largefile\n");
+      exit();
+    }
+    for(n = 0; n < nblock; n += sizeof(buf)/512){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf(1, "read largefile failed at block %d\n", n);
+        exit();
+      }
+      for(j = 0; j < sizeof(buf)/512; j++){
+        if(((int*)buf)[j*512/sizeof(int)] != n + j){
+          printf(1, "largefile block %d has wrong data\n", n + j);
+          exit();
+        }
+      }
+    }
+    if(read(fd, buf, 1) != 0){
+      printf(1, "largefile too long\n");
+      exit();
+    }
+    close(fd);
+    t2 = uptime();
+    unlink("largefile");
+    printf(1, "%d KB: write %d ticks, read %d ticks\n", sizes[i], t1 - t0, t2 - t1);
+  }
+
+  printf(1, "large files test ok\n");
+}
+
+// write two files a block at a time, alternately, so that
+// their blocks interleave on disk and each needs many extents.
+void
+fragfiles(void)
+{
+  int fd[2], i, j, k;
+  char *names[2] = { "frag0", "frag1" };
+
+  printf(1, "fragmented files test\n");
+
+  for(k = 0; k < 2; k++){
+    unlink(names[k]);
+    fd[k] = open(names[k], O_CREATE | O_RDWR);
+    if(fd[k] < 0){
+      printf(1, "cannot create %s\n", names[k]);
+      exit();
+    }
+  }
+  for(i = 0; i < 400; i++){
+    for(k = 0; k < 2; k++){
+      memset(buf, 'a' + k, 512);
+      ((int*)buf)[0] = i;
+      if(write(fd[k], buf, 512) != 512){
+        printf(1, "write %s failed at block %d\n", names[k], i);
+        exit();
+      }
+    }
+  }
+  for(k = 0; k < 2; k++){
+    close(fd[k]);
+    fd[k] = open(names[k], 0);
+    if(fd[k] < 0){
+      printf(1, "cannot open %s\n", names[k]);
+      exit();
+    }
+    for(i = 0; i < 400; i++){
+      if(read(fd[k], buf, 512) != 512){
+        printf(1, "read %s failed at block %d\n", names[k], i);
+        exit();
+      }
+      for(j = sizeof(int); j < 512; j++){
+        if(buf[j] != 'a' + k)
+          break;
+      }
+      if(((int*)buf)[0] != i || j != 512){
+        printf(1, "%s block %d has wrong data\n", names[k], i);
+        exit();
+      }
+    }
+    close(fd[k]);
+    unlink(names[k]);
+  }
+
+  printf(1, "fragmented files test ok\n");
+}
+
 void
 fourteen(void)
 {
@@ -1280,6 +1426,58 @@ rmdot(void)
   printf(1, "rmdot ok\n");
 }
 
+// The directory name cache must follow creates, links and
+// unlinks, and must forget a directory whose inode is reused.
+void
+dcachetest(void)
+{
+  int fd, i;
+
+  printf(1, "dcache test\n");
+  if(open("dcf", 0) >= 0){
+    printf(1, "dcf exists\n");
+    exit();
+  }
+  if((fd = open("dcf", O_CREATE|O_RDWR)) < 0){
+    printf(1, "create dcf failed\n");
+    exit();
+  }
+  close(fd);
+  if(link("dcf", "dcg") != 0 || (fd = open("dcg", 0)) < 0){
+    printf(1, "link dcg failed\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("dcf") != 0 || unlink("dcg") != 0){
+    printf(1, "unlink dcf failed\n");
+    exit();
+  }
+  if(open("dcf", 0) >= 0 || open("dcg", 0) >= 0){
+    printf(1, "unlinked dcf still opens\n");
+    exit();
+  }
+  for(i = 0; i < 10; i++){
+    if(mkdir("dcd") != 0){
+      printf(1, "mkdir dcd failed\n");
+      exit();
+    }
+    if((fd = open("dcd/x", 0)) >= 0){
+      printf(1, "dcd/x survived its directory\n");
+      exit();
+    }
+    if((fd = open("dcd/x", O_CREATE|O_RDWR)) < 0){
+      printf(1, "create dcd/x failed\n");
+      exit();
+    }
+    close(fd);
+    if(unlink("dcd/x") != 0 || unlink("dcd") != 0){
+      printf(1, "unlink dcd failed\n");
+      exit();
+    }
+  }
+  printf(1, "dcache ok\n");
+}
+
 void
 dirfile(void)
 {
@@ -1347,8 +1545,7 @@ iref(void)
 
   printf(1, "empty file name\n");
 
-  // the 50 is NINODE
-  for(i = 0; i < 50 + 1; i++){
+  for(i = 0; i < NINODE + 1; i++){
     if(mkdir("irefd") != 0){
       printf(1, "mkdir irefd failed\n");
       exit();
@@ -1369,6 +1566,14 @@ iref(void)
     unlink("xx");
   }
 
+  // remove the nested directories, so they do not fill the
+  // disk for later tests
+  for(i = 0; i < NINODE + 1; i++){
+    if(chdir("..") != 0 || unlink("irefd") != 0){
+      printf(1, "unlink irefd failed\n");
+      exit();
+    }
+  }
   chdir("/");
   printf(1, "empty file name OK\n");
 }
@@ -1411,6 +1616,238 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// mmap() a file, check its pages, and check that they
+// follow writes to the file and cannot themselves be written.
+void
+mmaptest(void)
+{
+  int fd, i, n, pid;
+  char *p;
+
+  printf(stdout, "mmap test\n");
+  n = 2*4096 + 1000;
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < n; i++)
+    buf[i % sizeof(buf)] = 'a' + i % 26;
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+     write(fd, buf, n - sizeof(buf)) != n - sizeof(buf)){
+    printf(stdout, "mmap test: write failed\n");
+    exit();
+  }
+  p = mmap(fd, 0, n);
+  if(p == (char*)-1){
+    printf(stdout, "mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    if(p[i] != 'a' + (i % sizeof(buf)) % 26){
+      printf(stdout, "mmap test: wrong byte %d\n", i);
+      exit();
+    }
+  }
+  if(p[n] != 0){
+    printf(stdout, "mmap test: not zero past end of file\n");
+    exit();
+  }
+
+  // writes to the file show up in the mapping
+  if(write(fd, "XYZ", 3) != 3){
+    printf(stdout, "mmap test: append failed\n");
+    exit();
+  }
+  if(p[n] != 'X' || p[n+2] != 'Z'){
+    printf(stdout, "mmap test: mapping missed a write\n");
+    exit();
+  }
+
+  // the kernel can read from a mapping
+  close(fd);
+  fd = open("mmapcopy", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, p + 4096, 4096) != 4096){
+    printf(stdout, "mmap test: write from mapping failed\n");
+    exit();
+  }
+  close(fd);
+
+  // a child inherits the mapping, but cannot write to it
+  pid = fork();
+  if(pid == 0){
+    if(p[4096] != 'a' + 4096 % 26){
+      printf(stdout, "mmap test: child sees wrong byte\n");
+      exit();
+    }
+    p[0] = 'z';
+    printf(stdout, "mmap test: wrote read-only mapping\n");
+    exit();
+  }
+  wait();
+  if(p[0] != 'a'){
+    printf(stdout, "mmap test: child changed the mapping\n");
+    exit();
+  }
+
+  if(munmap(p, 4096) < 0 || munmap(p + 4096, n + 3 - 4096) < 0){
+    printf(stdout, "munmap failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    printf(stdout, "mmap test: read %d after munmap\n", p[4096]);
+    exit();
+  }
+  wait();
+  unlink("mmapfile");
+  unlink("mmapcopy");
+  printf(stdout, "mmap test ok\n");
+}
+
+// fork() shares pages copy-on-write: parent and children
+// must each see only their own writes, including writes
+// the kernel makes for read().
+void
+cowtest(void)
+{
+  int i, j, pid, fds[2];
+  char *a;
+  uint n;
+
+  printf(stdout, "cow test\n");
+  n = 64*4096;
+  a = sbrk(n);
+  if(a == (char*)-1){
+    printf(stdout, "cow test: sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i += 4096)
+    a[i] = i / 4096;
+  if(pipe(fds) != 0){
+    printf(stdout, "cow test: pipe failed\n");
+    exit();
+  }
+
+  for(j = 0; j < 4; j++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "cow test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      if(read(fds[0], a + 1, 1) != 1 || a[1] != 'x'){
+        printf(stdout, "cow test: read into shared page failed\n");
+        exit();
+      }
+      for(i = 0; i < n; i += 4096){
+        if(a[i] != (char)(i / 4096)){
+          printf(stdout, "cow test: child saw a write\n");
+          exit();
+        }
+        a[i] = j;
+      }
+      exit();
+    }
+  }
+  for(j = 0; j < 4; j++)
+    write(fds[1], "x", 1);
+  for(j = 0; j < 4; j++)
+    wait();
+  for(i = 0; i < n; i += 4096){
+    if(a[i] != (char)(i / 4096) || a[i+1] == 'x'){
+      printf(stdout, "cow test: parent saw a child's write\n");
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-n);
+  printf(stdout, "cow test ok\n");
+}
+
+// sbrk() only reserves heap; pages appear when first touched,
+// whether by the process or by the kernel in a system call.
+void
+lazytest(void)
+{
+  int fd, i, pid;
+  char *a, *oldbrk;
+  uint n;
+
+  printf(stdout, "lazy test\n");
+  n = 1024*4096;
+  oldbrk = sbrk(0);
+  a = sbrk(n);
+  if(a == (char*)-1){
+    printf(stdout, "lazy test: sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i += 64*4096){
+    if(a[i] != 0){
+      printf(stdout, "lazy test: new page not zero\n");
+      exit();
+    }
+    a[i] = 'a';
+  }
+
+  // untouched pages passed to write() and read()
+  fd = open("lazyfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, a + 100*4096, 4096) != 4096){
+    printf(stdout, "lazy test: write from untouched page failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("lazyfile", O_RDONLY);
+  if(fd < 0 || read(fd, a + 200*4096 + 1, 4096) != 4096){
+    printf(stdout, "lazy test: read into untouched page failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("lazyfile");
+  for(i = 0; i < 4096; i++){
+    if(a[200*4096 + 1 + i] != 0){
+      printf(stdout, "lazy test: read wrong data\n");
+      exit();
+    }
+  }
+
+  // a child inherits untouched pages
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "lazy test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 4096; i < n; i += 64*4096){
+      if(a[i] != 0 || a[i - 4096] != 'a'){
+        printf(stdout, "lazy test: child saw wrong data\n");
+        exit();
+      }
+      a[i] = 'b';
+    }
+    exit();
+  }
+  wait();
+  for(i = 4096; i < n; i += 64*4096){
+    if(a[i] != 0){
+      printf(stdout, "lazy test: parent saw child's write\n");
+      exit();
+    }
+  }
+
+  // reservations count against free memory even if untouched
+  for(i = 0; i < 256; i++)
+    if(sbrk(4*1024*1024) == (char*)-1)
+      break;
+  if(i == 256){
+    printf(stdout, "lazy test: reserved more than memory\n");
+    exit();
+  }
+  sbrk(-(sbrk(0) - oldbrk));
+  if(sbrk(0) != oldbrk){
+    printf(stdout, "lazy test: shrink failed\n");
+    exit();
+  }
+  printf(stdout, "lazy test ok\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1768,11 +2205,17 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  cowtest();
+  lazytest();
+  mmaptest();
   validatetest();
+  textbusytest();
 
   opentest();
   writetest();
   writetest1();
+  largefiles();
+  fragfiles();
   createtest();
 
   openiputtest();
@@ -1791,6 +2234,7 @@ main(int argc, char *argv[])
   linktest();
   unlinkread();
   dirfile();
+  dcachetest();
   iref();
   forktest();
   bigdir(); // slow
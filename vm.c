@@ -6,6 +6,11 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "kstat.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -44,6 +49,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   } else {
     if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
       return 0;
+    kown((char*)pgtab, PG_PGTBL);
     // Make sure all those PTE_P bits are zero.
     memset(pgtab, 0, PGSIZE);
     // The permissions here are overly generous, but they can
@@ -123,6 +129,7 @@ setupkvm(void)
 
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
+  kown((char*)pgdir, PG_PGTBL);
   memset(pgdir, 0, PGSIZE);
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
@@ -187,35 +194,12 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
   mem = kalloc();
+  kown(mem, PG_USER);
   memset(mem, 0, PGSIZE);
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-  uint i, pa, n;
-  pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
-  }
-  return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -237,6 +221,7 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
+    kown(mem, PG_USER);
     memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
@@ -311,39 +296,67 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  The child shares the parent's pages;
+// writable ones become read-only and copy-on-write in both,
+// and cowfault() copies them on the first write.
+// pgdir must be the current page table.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+    // Skip heap pages that have not been touched yet.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
-    }
+    kdup(P2V(pa));
   }
+  lcr3(V2P(pgdir));  // flush the parent's writable TLB entries
   return d;
 
 bad:
+  lcr3(V2P(pgdir));
   freevm(d);
   return 0;
 }
 
+// Give the current process its own writable copy of the
+// copy-on-write page that pte maps, unless it is the only
+// process left sharing it.
+static int
+cowfault(pte_t *pte)
+{
+  uint pa;
+  char *mem;
+
+  pa = PTE_ADDR(*pte);
+  if(krefcount(P2V(pa)) > 1){
+    if((mem = kalloc()) == 0)
+      return -1;
+    kown(mem, PG_USER);
+    memmove(mem, P2V(pa), PGSIZE);
+    *pte = V2P(mem) | PTE_FLAGS(*pte);
+    kfree(P2V(pa));
+  }
+  *pte = (*pte | PTE_W) & ~PTE_COW;
+  lcr3(V2P(myproc()->pgdir));  // flush the read-only TLB entry
+  return 0;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -385,6 +398,290 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
   return 0;
 }
 
+//PAGEBREAK!
+// Mapped files.
+//
+// mmap() reserves address space for a file in p->vma but maps
+// no pages.  The first access to each page faults, and
+// pagefault() maps the page cache's copy of it, read-only.
+// Those pages are shared with every other mapping of the file,
+// so munmap() and munmapall() clear their PTEs and drop the
+// page cache references, rather than freeing the pages.
+
+// Return the mapping of p that contains va, or 0.
+static struct vma*
+findvma(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NMMAP]; v++)
+    if(v->f && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Return the lowest address used by p's mappings.
+// The heap may not grow past it.
+uint
+mmapfloor(struct proc *p)
+{
+  struct vma *v;
+  uint floor;
+
+  floor = MMAPTOP;
+  for(v = p->vma; v < &p->vma[NMMAP]; v++)
+    if(v->f && v->start < floor)
+      floor = v->start;
+  return floor;
+}
+
+// Map len bytes of file f, from page-aligned offset off,
+// into the current process below its other mappings.
+// Returns the address of the mapping, or -1.
+int
+mmap(struct file *f, uint off, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint floor;
+
+  if(f->type != FD_INODE || !f->readable || off % PGSIZE ||
+     len == 0 || len > MMAPTOP)
+    return -1;
+  for(v = p->vma; v < &p->vma[NMMAP]; v++)
+    if(v->f == 0)
+      break;
+  floor = mmapfloor(p);
+  if(v == &p->vma[NMMAP] || PGROUNDUP(len) > floor - PGROUNDUP(p->sz))
+    return -1;
+  v->end = floor;
+  v->start = floor - PGROUNDUP(len);
+  v->off = off;
+  v->f = filedup(f);
+  return v->start;
+}
+
+// Remove the PTEs of the pages of mapping v in [a, end).
+static void
+vmaunmap(struct proc *p, struct vma *v, uint a, uint end)
+{
+  pte_t *pte;
+
+  for(; a < end; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P)){
+      pcput(v->f->ip, (a - v->start + v->off) / PGSIZE);
+      *pte = 0;
+    }
+  }
+}
+
+// Unmap len bytes at addr from the current process.
+// The range must begin or end a mapping, not split one.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint end;
+
+  if(addr % PGSIZE || (v = findvma(p, addr)) == 0 || len == 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if(end < addr || end > v->end || (addr != v->start && end != v->end))
+    return -1;
+  vmaunmap(p, v, addr, end);
+  lcr3(V2P(p->pgdir));  // flush TLB
+  if(addr == v->start){
+    v->off += end - addr;
+    v->start = end;
+  } else
+    v->end = addr;
+  if(v->start == v->end){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  return 0;
+}
+
+// Unmap all of p's files, as exit() and exec() discard
+// its address space.  p will not run in that space again,
+// so there is no need to flush the TLB.
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NMMAP]; v++){
+    if(v->f){
+      vmaunmap(p, v, v->start, v->end);
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+}
+
+// Fault in the pages of [va, va+n), which must lie within
+// one mapping, so that the kernel can read them while it
+// holds locks.
+int
+mmapfault(uint va, uint n)
+{
+  struct vma *v;
+
+  if((v = findvma(myproc(), va)) == 0 || va + n < va || va + n > v->end)
+    return -1;
+  return uvmfault(va, n, 0);
+}
+
+//PAGEBREAK!
+// Page faults.
+//
+// Pages of the program are read from its file when first
+// touched, so exec() reads only what the program uses, and
+// come from the page cache, so processes running the same
+// program share them until they write them; pages of the
+// heap are allocated when first touched, so sbrk() only
+// moves p->sz; pages of mapped files are read through the
+// page cache when first touched; and shared copy-on-write
+// pages are copied when first written.
+
+// Return the segment of p's program that va lies in, or 0.
+static struct seg*
+findseg(struct proc *p, uint va)
+{
+  struct seg *s;
+
+  for(s = p->seg; s < &p->seg[NSEG]; s++)
+    if(s->memsz && va >= s->vaddr && va - s->vaddr < s->memsz)
+      return s;
+  return 0;
+}
+
+// Fill mem, the page at va in segment s, from p's program
+// file, leaving any bytes past the file content zero.
+static int
+loadseg(struct proc *p, struct seg *s, char *mem, uint va)
+{
+  int locked, r;
+  uint n;
+
+  if(va - s->vaddr >= s->filesz)
+    return 0;
+  n = s->filesz - (va - s->vaddr);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  // The faulting process may hold p->exe->lock already, in
+  // the middle of a system call.
+  if(!(locked = holdingsleep(&p->exe->lock)))
+    ilock(p->exe);
+  r = readi(p->exe, mem, s->off + (va - s->vaddr), n);
+  if(!locked)
+    iunlock(p->exe);
+  return r == n ? 0 : -1;
+}
+
+// Handle a page fault at address va in the current process;
+// err is the error code the processor pushed.  The fault may
+// come from the kernel, using a user page in a system call.
+// Returns 0 if the page is now mapped and the access can
+// be retried.
+int
+pagefault(uint va, uint err)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct seg *s;
+  pte_t *pte;
+  char *mem;
+  uint pgno, flags;
+
+  if(va >= KERNBASE)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P)){
+    if((err & FEC_WR) && (*pte & PTE_COW))
+      return cowfault(pte);
+    return -1;
+  }
+
+  if(va < p->sz){
+    // A page wholly from the program file is shared with
+    // every process running the program until written, if
+    // the page cache has room for it.
+    s = findseg(p, va);
+    if(s && va - s->vaddr + PGSIZE <= s->filesz && !(err & FEC_WR) &&
+       (mem = pctext(p->exe, s->off + (va - s->vaddr))) != 0){
+      flags = PTE_U|PTE_COW;
+    } else {
+      if((mem = kalloc()) == 0)
+        return -1;
+      kown(mem, PG_USER);
+      memset(mem, 0, PGSIZE);
+      if(s && loadseg(p, s, mem, va) < 0){
+        kfree(mem);
+        return -1;
+      }
+      flags = PTE_W|PTE_U;
+    }
+    if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), flags) < 0){
+      kfree(mem);
+      return -1;
+    }
+    p->lazy--;
+    kunreserve(1);
+    return 0;
+  }
+
+  if((v = findvma(p, va)) == 0 || (err & FEC_WR))
+    return -1;
+  pgno = (va - v->start + v->off) / PGSIZE;
+  if((mem = pcget(v->f->ip, pgno)) == 0)
+    return -1;
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), PTE_U) < 0){
+    pcput(v->f->ip, pgno);
+    return -1;
+  }
+  return 0;
+}
+
+// Count the pages from PGROUNDUP(a) up to b that are
+// not present, like those of the heap not touched yet.
+uint
+uvmabsent(pde_t *pgdir, uint a, uint b)
+{
+  pte_t *pte;
+  uint n;
+
+  n = 0;
+  for(a = PGROUNDUP(a); a < b; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & PTE_P) == 0)
+      n++;
+  }
+  return n;
+}
+
+// Fault in any pages of [va, va+n) in the current process
+// that are not present yet, and if the system call will write
+// them, copy any copy-on-write pages, so that it can use them
+// while it holds locks, and so that running out of memory
+// fails the call rather than the kernel.
+int
+uvmfault(uint va, uint n, int write)
+{
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(myproc()->pgdir, (char*)a, 0);
+    if((pte == 0 || (*pte & PTE_P) == 0 || (write && (*pte & PTE_COW))) &&
+       pagefault(a, write ? FEC_WR : 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!